@@ -22,11 +22,38 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <cstring>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <utility>
 #include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <csignal>
+#include <cerrno>
 #include <sys/time.h>
-#if defined PEXT
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#if defined __BMI2__
 #include <immintrin.h>
 #endif
+#if defined __x86_64__
+#include <cpuid.h>
+#endif
+#ifdef LIBRARY
+#include <stdexcept>
+#include "lastemperor.h"
+#endif
 
 // Namespace
 
@@ -39,10 +66,10 @@ struct Board {
   // Variables
 
   std::uint64_t 
-    white[6], black[6]; 
+    white[7], black[7], hash; // [6] = all pieces of that colour. hash = Zobrist key without side to move. No mailbox: 128 bytes
 
   std::int8_t 
-    pieces[64], epsq; 
+    epsq; 
 
   std::uint8_t 
     from, to, castle; 
@@ -52,32 +79,67 @@ struct Board {
   void reset();
 };
 
-struct MyHash {
+using Move = std::uint16_t; // from | to << 6 | flag << 12
+
+struct Undo { // What DoMove() can't recompute
 
   // Variables
 
-  std::uint64_t 
-    hash, nodes; 
+  std::uint64_t
+    hash;
 
-  std::uint8_t 
-    depth; 
+  std::int8_t
+    eat, epsq;
+
+  std::uint8_t
+    castle;
+};
+
+struct MyHash { // 16 bytes, shared by all threads. check = key ^ data so torn entries never verify
+
+  // Variables
+
+  std::atomic<std::uint64_t>
+    check, data; // data = depth | valid << 6 | age << 7 | nodes << 15
 
   // Functions
 
   MyHash();
 };
 
+struct alignas(64) MyBucket { // One cache line per probe
+
+  // Variables
+
+  MyHash
+    entry[4];
+};
+
+struct HashHeader { // Snapshot file: this header, padding up to kHashHeaderBytes, then the buckets
+
+  // Variables
+
+  char
+    magic[8];
+
+  std::uint64_t
+    format, zobrist, buckets; // format = entry size | entries per bucket << 8 | version << 16
+
+  std::uint8_t
+    age;
+};
+
 // Struct definitions
 
 void Board::reset() {
   epsq = from = to = castle = 0; 
-  memset(pieces, 0, sizeof(pieces)); 
+  hash = 0;
   memset(white, 0, sizeof(white)); 
   memset(black, 0, sizeof(black));
 }
 
 MyHash::MyHash() {
-  hash = nodes = depth = 0;
+  check = data = 0;
 }
 
 // Constexpr
@@ -85,8 +147,26 @@ MyHash::MyHash() {
 const std::string
   kName = "LastEmperor 1.2", kStartpos = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0";
 
+const std::vector<std::string>
+  kBenchSuite = {
+    // Normal : https://www.chessprogramming.org/Perft_Results
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 0",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0",
+    // Chess960 : https://www.chessprogramming.org/Chess960_Perft_Results
+    "bqnb1rkr/pp3ppp/3ppn2/2p5/5P2/P2P4/NPP1P1PP/BQ1BNRKR w HFhf - 0",
+    "bnqbnr1r/p1p1ppkp/3p4/1p4p1/P7/3NP2P/1PPP1PP1/BNQB1RKR w HF - 0",
+    "nrbq2kr/ppppppb1/5n1p/5Pp1/8/P5P1/1PPPP2P/NRBQNBKR w HBhb - 0",
+    "1r1bkqbr/pppp1ppp/2nnp3/8/2P5/N4P2/PP1PP1PP/1RNBKQBR w Hh - 0",
+    "rkqnbbnr/ppppppp1/8/7p/3N4/6PP/PPPPPP2/RKQNBB1R w HAa - 0",
+    "rbqkr1bn/pp1ppp2/2p1n2p/6p1/8/4BPNP/PPPPP1P1/RBQKRN2 w EAea - 0"
+  };
+
 constexpr int
-  kMaxMoves = 218, kRookVectors[8] = {1,0,0,1,0,-1,-1,0}, kBishopVectors[8] = {1,1,-1,-1,1,-1,-1,1}, kKingVectors[2 * 8] = {1,0,0,1,0,-1,-1,0,1,1,-1,-1,1,-1,-1,1},
+  kMaxMoves = 218, kHashMb = 256, kHashFormat = 2, kHashNodeBits = 49, kHashHeaderBytes = 1 << 16, kMoveEp = 1, kMoveOO = 2, kMoveOOO = 3, kMovePromo = 4 /* + piece - 2 */, kRookVectors[8] = {1,0,0,1,0,-1,-1,0}, kBishopVectors[8] = {1,1,-1,-1,1,-1,-1,1}, kKingVectors[2 * 8] = {1,0,0,1,0,-1,-1,0,1,1,-1,-1,1,-1,-1,1},
   kKightVectors[2 * 8] = {2,1,-2,1,2,-1,-2,-1,1,2,-1,2,1,-2,-1,-2};
 
 constexpr std::uint64_t
@@ -99,15 +179,6 @@ constexpr std::uint64_t
      0x17e0101010100ULL,0x27c0202020200ULL,0x47a0404040400ULL,0x8760808080800ULL,0x106e1010101000ULL,0x205e2020202000ULL,0x403e4040404000ULL,0x807e8080808000ULL,
      0x7e010101010100ULL,0x7c020202020200ULL,0x7a040404040400ULL,0x76080808080800ULL,0x6e101010101000ULL,0x5e202020202000ULL,0x3e404040404000ULL,0x7e808080808000ULL,
      0x7e01010101010100ULL,0x7c02020202020200ULL,0x7a04040404040400ULL,0x7608080808080800ULL,0x6e10101010101000ULL,0x5e20202020202000ULL,0x3e40404040404000ULL,0x7e80808080808000ULL},
-  kRookMoveMagics[64] =
-    {0x101010101017eULL,0x202020202027cULL,0x404040404047aULL,0x8080808080876ULL,0x1010101010106eULL,0x2020202020205eULL,0x4040404040403eULL,0x8080808080807eULL,
-     0x1010101017e00ULL,0x2020202027c00ULL,0x4040404047a00ULL,0x8080808087600ULL,0x10101010106e00ULL,0x20202020205e00ULL,0x40404040403e00ULL,0x80808080807e00ULL,
-     0x10101017e0100ULL,0x20202027c0200ULL,0x40404047a0400ULL,0x8080808760800ULL,0x101010106e1000ULL,0x202020205e2000ULL,0x404040403e4000ULL,0x808080807e8000ULL,
-     0x101017e010100ULL,0x202027c020200ULL,0x404047a040400ULL,0x8080876080800ULL,0x1010106e101000ULL,0x2020205e202000ULL,0x4040403e404000ULL,0x8080807e808000ULL,
-     0x1017e01010100ULL,0x2027c02020200ULL,0x4047a04040400ULL,0x8087608080800ULL,0x10106e10101000ULL,0x20205e20202000ULL,0x40403e40404000ULL,0x80807e80808000ULL,
-     0x17e0101010100ULL,0x27c0202020200ULL,0x47a0404040400ULL,0x8760808080800ULL,0x106e1010101000ULL,0x205e2020202000ULL,0x403e4040404000ULL,0x807e8080808000ULL,
-     0x7e010101010100ULL,0x7c020202020200ULL,0x7a040404040400ULL,0x76080808080800ULL,0x6e101010101000ULL,0x5e202020202000ULL,0x3e404040404000ULL,0x7e808080808000ULL,
-     0x7e01010101010100ULL,0x7c02020202020200ULL,0x7a04040404040400ULL,0x7608080808080800ULL,0x6e10101010101000ULL,0x5e20202020202000ULL,0x3e40404040404000ULL,0x7e80808080808000ULL},
   kBishopMask[64] =
     {0x40201008040200ULL,0x402010080400ULL,0x4020100a00ULL,0x40221400ULL,0x2442800ULL,0x204085000ULL,0x20408102000ULL,0x2040810204000ULL,
      0x20100804020000ULL,0x40201008040000ULL,0x4020100a0000ULL,0x4022140000ULL,0x244280000ULL,0x20408500000ULL,0x2040810200000ULL,0x4081020400000ULL,
@@ -117,44 +188,101 @@ constexpr std::uint64_t
      0x2000204081000ULL,0x4000408102000ULL,0xa000a10204000ULL,0x14001422400000ULL,0x28002844020000ULL,0x50005008040200ULL,0x20002010080400ULL,0x40004020100800ULL,
      0x20408102000ULL,0x40810204000ULL,0xa1020400000ULL,0x142240000000ULL,0x284402000000ULL,0x500804020000ULL,0x201008040200ULL,0x402010080400ULL,
      0x2040810204000ULL,0x4081020400000ULL,0xa102040000000ULL,0x14224000000000ULL,0x28440200000000ULL,0x50080402000000ULL,0x20100804020000ULL,0x40201008040200ULL},
-  kBishopMoveMagics[64] =
-    {0x40201008040200ULL,0x402010080400ULL,0x4020100a00ULL,0x40221400ULL,0x2442800ULL,0x204085000ULL,0x20408102000ULL,0x2040810204000ULL,
-     0x20100804020000ULL,0x40201008040000ULL,0x4020100a0000ULL,0x4022140000ULL,0x244280000ULL,0x20408500000ULL,0x2040810200000ULL,0x4081020400000ULL,
-     0x10080402000200ULL,0x20100804000400ULL,0x4020100a000a00ULL,0x402214001400ULL,0x24428002800ULL,0x2040850005000ULL,0x4081020002000ULL,0x8102040004000ULL,
-     0x8040200020400ULL,0x10080400040800ULL,0x20100a000a1000ULL,0x40221400142200ULL,0x2442800284400ULL,0x4085000500800ULL,0x8102000201000ULL,0x10204000402000ULL,
-     0x4020002040800ULL,0x8040004081000ULL,0x100a000a102000ULL,0x22140014224000ULL,0x44280028440200ULL,0x8500050080400ULL,0x10200020100800ULL,0x20400040201000ULL,
-     0x2000204081000ULL,0x4000408102000ULL,0xa000a10204000ULL,0x14001422400000ULL,0x28002844020000ULL,0x50005008040200ULL,0x20002010080400ULL,0x40004020100800ULL,
-     0x20408102000ULL,0x40810204000ULL,0xa1020400000ULL,0x142240000000ULL,0x284402000000ULL,0x500804020000ULL,0x201008040200ULL,0x402010080400ULL,
-     0x2040810204000ULL,0x4081020400000ULL,0xa102040000000ULL,0x14224000000000ULL,0x28440200000000ULL,0x50080402000000ULL,0x20100804020000ULL,0x40201008040200ULL};
+  kRookMagic[64] = { // Fancy magics: one bit per mask square, no more
+    0x8080048820104000ULL,0x40004020001001ULL,0x8200104200208009ULL,0x1100201001000805ULL,0x100041003000800ULL,0x900080400210002ULL,0x8400108409221008ULL,0x20000442c010882ULL,
+    0x6420800020804001ULL,0x22002040810208ULL,0x202801000802000ULL,0x1000825001000ULL,0x5000800047100ULL,0x240800200800401ULL,0x5000402000900ULL,0x20800080006100ULL,
+    0x1480004000200041ULL,0x440004020100044ULL,0x4084801004a000ULL,0x20b10a0010402200ULL,0x27808004008800ULL,0x802008080040002ULL,0x5080040090010208ULL,0x34a0220000408114ULL,
+    0x20c0002080004090ULL,0x4800400100208100ULL,0x10208200420010ULL,0x21000900211000ULL,0x1001100080104ULL,0x118020080040080ULL,0x1030420400100148ULL,0x800800420000ac01ULL,
+    0x108000200c400641ULL,0x80400081002100ULL,0xc000100484802000ULL,0x8420080080801001ULL,0x5302100801000500ULL,0x1011000401000802ULL,0x2010321004000118ULL,0x2021084200008cULL,
+    0x880002000404000ULL,0x201004434001ULL,0x110020010042ULL,0x40210050030028ULL,0x2018040008008080ULL,0x204010002004040ULL,0x4a0010002008080ULL,0x83000080410002ULL,
+    0x8f218102004200ULL,0x401002200440ULL,0x2000200010008280ULL,0x801080010008480ULL,0x100c000800802480ULL,0x8008800400020080ULL,0x427108100400ULL,0x100001188c004200ULL,
+    0x1000800100102049ULL,0x2002050020104882ULL,0x110208200041ULL,0x10041000200901ULL,0x3000800029005ULL,0x1021000204000801ULL,0x1020900088020104ULL,0x3010c2401025082ULL},
+  kBishopMagic[64] = {
+    0x80284820980c4100ULL,0x4100400c08200a0ULL,0x1608080060802480ULL,0x1220a0604440010ULL,0x844042000200031ULL,0x400a082405810800ULL,0x608414420202400ULL,0x9000840108020200ULL,
+    0x5000110208880080ULL,0x101002104040ULL,0x108208d020500ULL,0x8000280a10a0c400ULL,0x408011040002004ULL,0x402104a0440c21ULL,0x2180010108024004ULL,0x4404408404020200ULL,
+    0x10043012a0024400ULL,0x4182000524180200ULL,0x410007d00408104ULL,0x40a102022004004ULL,0x10101202100040ULL,0x8001801900a00900ULL,0x2000404422021001ULL,0x2005080021211005ULL,
+    0x108400020040104ULL,0x804a009210800ULL,0x8104100041024086ULL,0x204010020200880ULL,0x301010008104000ULL,0x3580020a2100400ULL,0x807044a09080804ULL,0x2020002b98208ULL,
+    0x2801084800421018ULL,0x9214100200040460ULL,0x2422005104100300ULL,0x1124020080080080ULL,0x200408020020200ULL,0x420090040820808ULL,0x1080280230454ULL,0x4144140108422ULL,
+    0xa51042020400400ULL,0x4092021004400240ULL,0x4006602030111800ULL,0x400084208000080ULL,0x901902a10101200ULL,0x3d0011001000420ULL,0x3004908400400100ULL,0x4002020204218200ULL,
+    0x2101180212603251ULL,0x620100a801080084ULL,0x90118048680101ULL,0x40000020880080ULL,0x30002a883040000ULL,0x1200411021000ULL,0x600a200404144000ULL,0x64010404029000ULL,
+    0x410400a24000ULL,0x4801008424220200ULL,0x4c2201052009000ULL,0x80a4000001228800ULL,0x8100228130020888ULL,0x202100414080a08ULL,0xa08441002481110ULL,0x210500080908200ULL};
 
 // Variables
 
+thread_local std::uint64_t
+  g_black = 0, g_both = 0, g_empty = 0, g_good = 0, g_white = 0, g_checkers = 0, g_attacked = 0, g_pinned = 0, g_pin[64] = {};
+
 std::uint64_t
-  g_black = 0, g_both = 0, g_empty = 0, g_good = 0, g_pawn_sq = 0, g_white = 0, g_pawn_1_moves_w[64] = {}, g_pawn_1_moves_b[64] = {}, g_pawn_2_moves_w[64] = {}, 
-  g_pawn_2_moves_b[64] = {}, g_zobrist_ep[64]= {}, g_zobrist_castle[16] = {}, g_zobrist_wtm[2] = {}, g_zobrist_board[13][64] = {{}}, g_castle_w[2] = {}, g_castle_b[2] = {}, 
-  g_castle_empty_w[2] = {}, g_castle_empty_b[2] = {}, g_bishop_moves[64] = {}, g_rook_moves[64] = {}, g_queen_moves[64] = {}, g_knight_moves[64] = {}, g_king_moves[64] = {}, 
-  g_pawn_checks_w[64] = {}, g_pawn_checks_b[64] = {}, g_bishop_magic_moves[64][512] = {{}}, g_rook_magic_moves[64][4096] = {{}}, g_seed = 131783, g_hash_key = 1;
+  g_seed = 131783;
+
+thread_local std::uint64_t // This thread's hashtable: helper threads get it through Setup, library contexts own one each
+  g_hash_key = 1;
+
+const std::uint64_t
+  *g_bishop_magic_moves[64] = {}, *g_rook_magic_moves[64] = {}; // Rows of the PEXT or the magic tables
+
+thread_local std::uint8_t
+  g_hash_age = 0;
+
+thread_local std::uint64_t // Castling setup of the position this thread works on
+  g_castle_w[2] = {}, g_castle_b[2] = {}, g_castle_empty_w[2] = {}, g_castle_empty_b[2] = {};
+
+thread_local int
+  g_king_w = 0, g_king_b = 0, g_rook_w[2] = {}, g_rook_b[2] = {};
 
 int
-  g_king_w = 0, g_king_b = 0, g_moves_n = 0, g_rook_w[2] = {}, g_rook_b[2] = {};
+  g_threads = 1, g_batch = 0; // g_batch = SIMD lanes of the leaf counter. 0 = scalar
+
+thread_local int
+  g_moves_n = 0;
+
+thread_local std::uint64_t
+  g_copied = 0; // Bytes written per generated move: whole boards or Undo records
 
-MyHash
+std::atomic<std::uint64_t>
+  g_copied_workers(0);
+
+thread_local Move
+  *g_move_list = 0;
+
+thread_local MyBucket
   *g_myhash = 0;
 
-Board
-  g_board_tmp, *g_board = &g_board_tmp, *g_moves = 0, *g_board_original = 0;
+thread_local std::size_t
+  g_hash_bytes = 0;
 
-bool
+std::string
+  g_hash_load = "", g_hash_save = "", g_hash_save_tmp = "";
+
+std::atomic<int>
+  g_hash_signal(0); // SIGINT or SIGTERM seen: the handler only sets it
+
+thread_local bool
+  g_hash_saver = false; // main(): its g_myhash is the table -hash-save is for
+
+thread_local Board
+  g_board_tmp;
+
+thread_local Board
+  *g_board = &g_board_tmp, *g_moves = 0, *g_board_original = 0;
+
+thread_local bool
   g_wtm = true;
 
+bool
+  g_makeunmake = false, g_pext = false;
+
 std::string
+  g_slider = "auto", g_simd = "auto";
+
+thread_local std::string
   g_fen = kStartpos;
 
 // Prototypes
 
-std::uint64_t PerftB(const int);
 std::uint64_t RookMagicMoves(const int, const std::uint64_t);
 std::uint64_t BishopMagicMoves(const int, const std::uint64_t);
+const std::string MoveName(const Board*, const Board*);
 
 // Utils
 
@@ -162,11 +290,11 @@ template <class Type> Type Between(const Type x, const Type y, const Type z) {
   return std::max(x, std::min(y, z));
 }
 
-inline std::uint8_t Xcoord(const std::uint8_t sq) {
+constexpr std::uint8_t Xcoord(const std::uint8_t sq) {
   return sq & 7;
 }
 
-inline std::uint8_t Ycoord(const std::uint8_t sq) {
+constexpr std::uint8_t Ycoord(const std::uint8_t sq) {
   return sq >> 3;
 }
 
@@ -178,31 +306,47 @@ inline std::uint64_t ClearBit(const std::uint64_t bb) {
   return bb & (bb - 0x1ULL);
 }
 
-inline std::uint64_t Bit(const int nbits) {
+constexpr std::uint64_t Bit(const int nbits) {
   return 0x1ULL << nbits;
 }
 
-bool OnBoard(const int x, const int y) {
+constexpr bool OnBoard(const int x, const int y) {
   return x >= 0 && x <= 7 && y >= 0 && y <= 7;
 }
 
 inline std::uint64_t White() {
-  return g_board->white[0] | g_board->white[1] | g_board->white[2] | g_board->white[3] | g_board->white[4] | g_board->white[5];
+  return g_board->white[6];
 }
 
 inline std::uint64_t Black() {
-  return g_board->black[0] | g_board->black[1] | g_board->black[2] | g_board->black[3] | g_board->black[4] | g_board->black[5];
+  return g_board->black[6];
 }
 
 inline std::uint64_t Both() {
   return White() | Black();
 }
 
+inline int PieceOf(const std::uint64_t *side, const int sq) { // 1..6 or 0
+  const std::uint64_t bit = 0x1ULL << sq;
+  if (!(side[6] & bit)) return 0;
+  for (int i = 0; i < 5; i++) if (side[i] & bit) return i + 1;
+  return 6;
+}
+
+inline int PieceAt(const int sq, const Board *board = g_board) { // Signed piece from the bitboards
+  return PieceOf(board->white, sq) - PieceOf(board->black, sq);
+}
+
+inline void PutPiece(const int piece, const int sq) {
+  if (piece > 0) {g_board->white[piece - 1] |= 0x1ULL << sq; g_board->white[6] |= 0x1ULL << sq;}
+  if (piece < 0) {g_board->black[-piece - 1] |= 0x1ULL << sq; g_board->black[6] |= 0x1ULL << sq;}
+}
+
 inline int Ctz(const std::uint64_t bb) {
   return __builtin_ctzll(bb);
 }
 
-inline int PopCount(const std::uint64_t bb) {
+constexpr int PopCount(const std::uint64_t bb) {
   return __builtin_popcountll(bb);
 }
 
@@ -218,8 +362,12 @@ template <class Type> void Splitter(const std::string& str, Type& container, con
 
 void Assert(const bool test, const std::string msg) {
   if (test) return;
+#ifdef LIBRARY
+  throw std::runtime_error(msg); // The API call returns -1 and keeps msg
+#else
   std::cerr << msg << std::endl;
   exit(EXIT_FAILURE);
+#endif
 }
 
 std::uint64_t Now() {
@@ -228,70 +376,448 @@ std::uint64_t Now() {
   return (std::uint64_t) (1000 * tv.tv_sec + tv.tv_usec / 1000);
 }
 
-std::uint64_t RandomBB() { // Deterministic
-  static std::uint64_t va = 0X12311227ULL, vb = 0X1931311ULL, vc = 0X13138141ULL;
-  va ^= vb + vc;
-  vb ^= vb * vc + 0x1717711ULL;
-  vc  = (3 * vc) + 1;
-  constexpr auto mixer = [](const std::uint64_t val) {return (val << 7) ^ (val >> 5);};
-  return mixer(va) ^ mixer(vb) ^ mixer(vc);
+// Tables (the compiler builds them: startup computes nothing)
+
+struct Random { // Deterministic
+  std::uint64_t va = 0X12311227ULL, vb = 0X1931311ULL, vc = 0X13138141ULL;
+
+  constexpr std::uint64_t bb() {
+    va ^= vb + vc;
+    vb ^= vb * vc + 0x1717711ULL;
+    vc  = (3 * vc) + 1;
+    constexpr auto mixer = [](const std::uint64_t val) {return (val << 7) ^ (val >> 5);};
+    return mixer(va) ^ mixer(vb) ^ mixer(vc);
+  }
+
+  constexpr std::uint64_t next() {
+    std::uint64_t val = 0;
+    for (int i = 0; i < 8; i++) val ^= bb() << (8 * i);
+    return val;
+  }
+};
+
+struct Zobrist {
+  std::uint64_t board[13][64], ep[64], castle[16], wtm[2];
+};
+
+constexpr Zobrist MakeZobrist() { // Same draw order as ever: snapshots stay valid
+  Zobrist zobrist = {};
+  Random random;
+  for (int i = 0; i < 13; i++) for (int j = 0; j < 64; j++) zobrist.board[i][j] = random.next();
+  for (int i = 0; i < 64; i++) zobrist.ep[i]     = random.next();
+  for (int i = 0; i < 16; i++) zobrist.castle[i] = random.next();
+  for (int i = 0; i <  2; i++) zobrist.wtm[i]    = random.next();
+  return zobrist;
+}
+
+constexpr std::uint64_t MakeSliderMoves(const int *slider_vectors, const int square, const std::uint64_t occupied) { // Rays up to and including the first blocker
+  std::uint64_t moves = 0;
+  for (int i = 0; i < 4; i++) {
+    for (int j = 1; j < 8; j++) {
+      const int x = Xcoord(square) + j * slider_vectors[2 * i], y = Ycoord(square) + j * slider_vectors[2 * i + 1];
+      if (!OnBoard(x, y)) break;
+      moves |= Bit(8 * y + x);
+      if (Bit(8 * y + x) & occupied) break;
+    }
+  }
+  return moves;
+}
+
+constexpr std::uint64_t MakeJumpMoves(const int square, const int len, const int dy, const int *jump_vectors) {
+  std::uint64_t moves = 0;
+  for (int i = 0; i < len; i++) {
+    const int x = Xcoord(square) + jump_vectors[2 * i], y = Ycoord(square) + dy * jump_vectors[2 * i + 1];
+    if (OnBoard(x, y)) moves |= Bit(8 * y + x);
+  }
+  return moves;
+}
+
+template <class Make> constexpr std::array<std::uint64_t, 64> MakeSquares(const Make make) {
+  std::array<std::uint64_t, 64> table = {};
+  for (int i = 0; i < 64; i++) table[i] = make(i);
+  return table;
+}
+
+constexpr std::array<std::array<std::uint64_t, 64>, 64> MakeBetween() { // Squares strictly between two aligned squares
+  std::array<std::array<std::uint64_t, 64>, 64> between = {};
+  for (int i = 0; i < 64; i++) {
+    for (int k = 0; k < 8; k++) {
+      std::uint64_t squares = 0;
+      for (int j = 1; j < 8; j++) {
+        const int x = Xcoord(i) + j * kKingVectors[2 * k], y = Ycoord(i) + j * kKingVectors[2 * k + 1];
+        if (!OnBoard(x, y)) break;
+        between[i][8 * y + x] = squares;
+        squares |= Bit(8 * y + x);
+      }
+    }
+  }
+  return between;
+}
+
+constexpr std::array<std::uint64_t, 64>
+  kRookShift   = MakeSquares([](const int sq) {return 64 - PopCount(kRookMask[sq]);}),
+  kBishopShift = MakeSquares([](const int sq) {return 64 - PopCount(kBishopMask[sq]);});
+
+template <bool rook, int sq> constexpr std::size_t kSliderRowSize = std::size_t(1) << PopCount(rook ? kRookMask[sq] : kBishopMask[sq]); // 32 .. 4096
+
+template <bool rook, bool pext, int sq> constexpr std::array<std::uint64_t, kSliderRowSize<rook, sq>> MakeSliderRow() { // Every blocker subset of the mask at its PEXT or magic index
+  std::array<std::uint64_t, kSliderRowSize<rook, sq>> row = {};
+  const std::uint64_t mask = rook ? kRookMask[sq] : kBishopMask[sq];
+  std::uint64_t occupied = 0, n = 0;
+  do {
+    const std::uint64_t moves = MakeSliderMoves(rook ? kRookVectors : kBishopVectors, sq, occupied),
+                        index = pext ? n : (occupied * (rook ? kRookMagic[sq] : kBishopMagic[sq])) >> (rook ? kRookShift[sq] : kBishopShift[sq]);
+    if (row[index] && row[index] != moves) throw "Bad magic"; // Stops the build
+    row[index] = moves;
+    occupied = (occupied - mask) & mask; // Next subset. This order is the PEXT order
+    n++;
+  } while (occupied);
+  return row;
 }
 
-std::uint64_t Random8x64() {
-  std::uint64_t val = 0;
-  for (int i = 0; i < 8; i++) val ^= RandomBB() << (8 * i);
-  return val;
+template <bool rook, bool pext, int sq> constexpr std::array<std::uint64_t, kSliderRowSize<rook, sq>> kSliderRow = MakeSliderRow<rook, pext, sq>(); // One constant per row keeps every evaluation small
+
+template <bool rook, bool pext, std::size_t... sq> constexpr std::array<const std::uint64_t*, 64> MakeSliderRows(std::index_sequence<sq...>) {
+  return {kSliderRow<rook, pext, sq>.data()...};
 }
 
+constexpr int
+  kPawn1Vectors[1 * 2] = {0,1}, kPawnCheckVectors[2 * 2] = {-1,1,1,1};
+
+constexpr Zobrist
+  kZobrist = MakeZobrist();
+
+constexpr std::array<std::uint64_t, 64>
+  kKingMoves    = MakeSquares([](const int sq) {return MakeJumpMoves(sq, 8, 1, kKingVectors);}),
+  kKnightMoves  = MakeSquares([](const int sq) {return MakeJumpMoves(sq, 8, 1, kKightVectors);}),
+  kPawnChecksW  = MakeSquares([](const int sq) {return MakeJumpMoves(sq, 2,  1, kPawnCheckVectors);}),
+  kPawnChecksB  = MakeSquares([](const int sq) {return MakeJumpMoves(sq, 2, -1, kPawnCheckVectors);}),
+  kPawn1MovesW  = MakeSquares([](const int sq) {return MakeJumpMoves(sq, 1,  1, kPawn1Vectors);}),
+  kPawn1MovesB  = MakeSquares([](const int sq) {return MakeJumpMoves(sq, 1, -1, kPawn1Vectors);}),
+  kPawn2MovesW  = MakeSquares([](const int sq) {return Ycoord(sq) == 1 ? MakeJumpMoves(sq, 1,  1, kPawn1Vectors) | MakeJumpMoves(sq, 1,  2, kPawn1Vectors) : 0;}),
+  kPawn2MovesB  = MakeSquares([](const int sq) {return Ycoord(sq) == 6 ? MakeJumpMoves(sq, 1, -1, kPawn1Vectors) | MakeJumpMoves(sq, 1, -2, kPawn1Vectors) : 0;}),
+  kRookMoves    = MakeSquares([](const int sq) {return MakeSliderMoves(kRookVectors,   sq, 0);}),
+  kBishopMoves  = MakeSquares([](const int sq) {return MakeSliderMoves(kBishopVectors, sq, 0);}),
+  kQueenMoves   = MakeSquares([](const int sq) {return kRookMoves[sq] | kBishopMoves[sq];});
+
+constexpr std::array<std::array<std::uint64_t, 64>, 64>
+  kBetween = MakeBetween();
+
+constexpr std::array<const std::uint64_t*, 64>
+  kRookPextRows    = MakeSliderRows<true,  true >(std::make_index_sequence<64>()),
+  kRookMagicRows   = MakeSliderRows<true,  false>(std::make_index_sequence<64>()),
+  kBishopPextRows  = MakeSliderRows<false, true >(std::make_index_sequence<64>()),
+  kBishopMagicRows = MakeSliderRows<false, false>(std::make_index_sequence<64>());
+
 // Hash
 
-inline std::uint64_t Hash(const int wtm) {
-  std::uint64_t hash = g_zobrist_ep[g_board->epsq + 1] ^ g_zobrist_wtm[wtm] ^ g_zobrist_castle[g_board->castle], both = Both();
+std::uint64_t HashBoard() { // Full recompute
+  std::uint64_t hash = kZobrist.ep[g_board->epsq + 1] ^ kZobrist.castle[g_board->castle], both = Both();
   for (; both; both = ClearBit(both)) {
     const auto sq = Ctz(both); 
-    hash ^= g_zobrist_board[g_board->pieces[sq] + 6][sq];
+    hash ^= kZobrist.board[PieceAt(sq) + 6][sq];
   }
   return hash;
 }
 
+inline std::uint64_t Hash(const int wtm) {
+#ifdef HASHCHECK
+  Assert(g_board->hash == HashBoard(), "Error #6: Incremental hash mismatch");
+#endif
+  return g_board->hash ^ kZobrist.wtm[wtm];
+}
+
+inline void HashPiece(const int piece, const int sq) {
+  g_board->hash ^= kZobrist.board[piece + 6][sq];
+}
+
+inline void HashMove(const int piece, const int from, const int to) {
+  g_board->hash ^= kZobrist.board[piece + 6][from] ^ kZobrist.board[piece + 6][to];
+}
+
+inline void HashState() { // ep and castling rights vs the parent
+  g_board->hash ^= kZobrist.ep[g_board_original->epsq + 1] ^ kZobrist.ep[g_board->epsq + 1] ^ kZobrist.castle[g_board_original->castle] ^ kZobrist.castle[g_board->castle];
+}
+
 void HashtableFreeMemory() {
   if (!g_myhash) return;
-  delete[] g_myhash;
+  munmap(g_myhash, g_hash_bytes);
   g_myhash = 0;
 }
 
-void HashtableSetSize(const int usize) {
-  if (usize <= 0) return;
+void *HashtableMap(const std::size_t bytes) { // Explicit huge pages if reserved, else THP. Pages come zeroed from the OS
+  void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) return mem;
+#endif
+  mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(mem != MAP_FAILED, "Error #5: Can't allocate hashtable");
+#ifdef MADV_HUGEPAGE
+  madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+  return mem;
+}
+
+void HashtableClear() { // Same size, every entry empty
+  std::memset((void*) g_myhash, 0, g_hash_bytes);
+}
+
+void HashtableTouch(char *mem, const std::size_t bytes, const int id) { // Fault in our slice of the table so the page faults run in parallel
+  const std::size_t slice = bytes / g_threads;
+  for (std::size_t i = id * slice; i < (id + 1) * slice; i += 4096) mem[i] = 0;
+}
+
+void HashtableSetSize(const int usize) { // 0 keeps the current table (or allocates the default)
+  if (usize <= 0 && g_myhash) return;
   HashtableFreeMemory();
-  std::uint64_t hashsize = (1 << 20) * Between<std::uint64_t>(1, (std::uint64_t) usize, 1024 * 1024);
-  std::uint32_t hash_count = 1;
-  for (const std::uint32_t max_count = (std::uint32_t) (hashsize / sizeof(MyHash)); hash_count < max_count; hash_count *= 2);
-  hash_count /= 2;
+  std::uint64_t hashsize = (1 << 20) * Between<std::uint64_t>(1, (std::uint64_t) (usize > 0 ? usize : kHashMb), 1024 * 1024);
+  std::uint64_t hash_count = 1; // The most buckets that fit: 1024 MB gets 1024 MB
+  for (const std::uint64_t max_count = hashsize / sizeof(MyBucket); 2 * hash_count <= max_count; hash_count *= 2);
   g_hash_key = hash_count - 1;
-  g_myhash = new MyHash[hash_count];
+  g_hash_bytes = ((hash_count * sizeof(MyBucket) - 1) | ((1 << 21) - 1)) + 1; // Whole 2 MB pages
+  g_myhash = (MyBucket*) HashtableMap(g_hash_bytes); // All-zero bytes are empty entries, no constructors needed
+  if (g_threads <= 1) return;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < g_threads; i++) threads.emplace_back(HashtableTouch, (char*) g_myhash, g_hash_bytes, i);
+  for (auto &thread : threads) thread.join();
 }
 
-std::uint64_t GetPerft(const std::uint64_t hash, const std::uint8_t depth) {
-  const MyHash *entry = &g_myhash[(std::uint32_t) (hash & g_hash_key)];
-  return entry->hash == hash && entry->depth == depth ? entry->nodes : 0;
+int HashWorth(const std::uint64_t data) { // log2(subtree) minus 4 per search since stored. Empty slots go first
+  if (!(data & 64)) return -1024;
+  return ((data >> 15) ? 63 - __builtin_clzll(data >> 15) : 0) - 4 * (std::uint8_t) (g_hash_age - (data >> 7));
 }
 
-void AddPerft(const std::uint64_t hash, const std::uint64_t nodes, const std::uint8_t depth) {
-  MyHash *entry = &g_myhash[(std::uint32_t) (hash & g_hash_key)];
-  if (!nodes || (entry->hash == hash && entry->nodes > nodes)) return;
-  entry->hash  = hash;
-  entry->depth = depth;
-  entry->nodes = nodes;
+inline std::uint64_t HashData(const std::uint64_t nodes, const std::uint8_t depth) {
+  return (nodes << 15) | ((std::uint64_t) g_hash_age << 7) | 64 | (depth & 63);
 }
 
-// Board
+inline bool HashMatch(const MyHash *entry, const std::uint64_t hash, const std::uint8_t depth, std::uint64_t &data) { // Valid, same key, same depth
+  data = entry->data.load(std::memory_order_relaxed);
+  return (entry->check.load(std::memory_order_relaxed) ^ data) == hash && (data & 127) == (64 | (depth & 63));
+}
+
+#ifdef HASHSTATS
+struct HashStats { // Per thread, summed when printed. Index = depth (of the new entry for overwrites)
+  std::uint64_t probes[64], hits[64], stores[64], refused[64], overwrites[64];
+};
+
+std::deque<HashStats>
+  g_hash_stats_all; // Outlives the helper threads
+
+std::vector<HashStats*>
+  g_hash_stats_free; // Slots of threads that are gone
+
+HashStats
+  g_hash_stats_done; // Their counts
+
+std::mutex
+  g_hash_stats_lock;
+
+void HashStatsAdd(HashStats &sum, const HashStats &stats) {
+  for (int i = 0; i < 64; i++) {
+    sum.probes[i]     += stats.probes[i];
+    sum.hits[i]       += stats.hits[i];
+    sum.stores[i]     += stats.stores[i];
+    sum.refused[i]    += stats.refused[i];
+    sum.overwrites[i] += stats.overwrites[i];
+  }
+}
+
+struct HashStatsSlot { // Borrowed for the thread's life, so the server and library threads coming and going don't grow the deque
+  HashStats *stats;
+  HashStatsSlot();
+  ~HashStatsSlot();
+  HashStats *operator->() {return stats;}
+};
+
+HashStatsSlot::HashStatsSlot() {
+  std::lock_guard<std::mutex> guard(g_hash_stats_lock);
+  if (g_hash_stats_free.empty()) {
+    g_hash_stats_all.emplace_back();
+    stats = &g_hash_stats_all.back();
+  } else {
+    stats = g_hash_stats_free.back();
+    g_hash_stats_free.pop_back();
+  }
+}
+
+HashStatsSlot::~HashStatsSlot() {
+  std::lock_guard<std::mutex> guard(g_hash_stats_lock);
+  HashStatsAdd(g_hash_stats_done, *stats);
+  *stats = HashStats();
+  g_hash_stats_free.push_back(stats);
+}
+
+thread_local HashStatsSlot
+  g_hash_stats;
+
+void HashStatsReset() {
+  std::lock_guard<std::mutex> guard(g_hash_stats_lock);
+  for (auto &stats : g_hash_stats_all) stats = HashStats();
+  g_hash_stats_done = HashStats();
+}
+
+void HashStatsPrint() { // Fill from the first 4096 buckets: share of slots used and which depths hold them
+  HashStats sum = {};
+  std::uint64_t used = 0, slots = 0, held[64] = {};
+  {
+    std::lock_guard<std::mutex> guard(g_hash_stats_lock);
+    HashStatsAdd(sum, g_hash_stats_done);
+    for (const auto &stats : g_hash_stats_all) HashStatsAdd(sum, stats);
+  }
+  for (std::uint64_t i = 0; i <= std::min<std::uint64_t>(g_hash_key, 4095); i++) {
+    for (const auto &entry : g_myhash[i].entry) {
+      slots++;
+      const std::uint64_t data = entry.data.load(std::memory_order_relaxed);
+      if (!(data & 64)) continue;
+      used++;
+      held[data & 63]++;
+    }
+  }
+  std::cout << "\nHash    Probes      Hits   Hit%     Stores   Refused  Overwrites  Fill%" << std::endl;
+  for (int i = 0; i < 64; i++) {
+    if (!sum.probes[i] && !sum.stores[i] && !held[i]) continue;
+    std::cout << std::setw(4) << i << std::setw(10) << sum.probes[i] << std::setw(10) << sum.hits[i] << std::setw(7) << std::fixed << std::setprecision(1)
+              << (sum.probes[i] ? 100.0 * (double) sum.hits[i] / (double) sum.probes[i] : 0.0) << std::setw(11) << sum.stores[i] << std::setw(10) << sum.refused[i]
+              << std::setw(12) << sum.overwrites[i] << std::setw(7) << (slots ? 100.0 * (double) held[i] / (double) slots : 0.0) << std::endl;
+  }
+  std::cout << "Fill: " << std::fixed << std::setprecision(1) << (slots ? 100.0 * (double) used / (double) slots : 0.0) << "% of " << slots << " sampled slots" << std::endl;
+}
+#else
+inline void HashStatsReset() {}
+inline void HashStatsPrint() {}
+#endif
+
+bool GetPerft(const std::uint64_t hash, const std::uint8_t depth, std::uint64_t &nodes) { // Zero counts (mates, stalemates) are hits too
+  const MyHash *entry = g_myhash[hash & g_hash_key].entry;
+#ifdef HASHSTATS
+  g_hash_stats->probes[depth & 63]++;
+#endif
+  for (int i = 0; i < 4; i++, entry++) {
+    std::uint64_t data;
+    if (HashMatch(entry, hash, depth, data)) {
+#ifdef HASHSTATS
+      g_hash_stats->hits[depth & 63]++;
+#endif
+      nodes = data >> 15;
+      return true;
+    }
+  }
+  return false;
+}
+
+void AddPerft(const std::uint64_t hash, const std::uint64_t nodes, const std::uint8_t depth) { // Replace the same key or the least worth. Counts past 49 bits aren't kept
+  MyHash *entry = g_myhash[hash & g_hash_key].entry, *victim = entry;
+  int worst = 1024;
+#ifdef HASHSTATS
+  g_hash_stats->stores[depth & 63]++;
+  if (nodes >> kHashNodeBits) g_hash_stats->refused[depth & 63]++;
+#endif
+  if (nodes >> kHashNodeBits) return;
+  for (int i = 0; i < 4; i++, entry++) {
+    std::uint64_t data;
+    if (HashMatch(entry, hash, depth, data)) {victim = entry; break;}
+    const int worth = HashWorth(data);
+    if (worth < worst) {worst = worth; victim = entry;}
+  }
+#ifdef HASHSTATS
+  if (std::uint64_t old_data = 0; !HashMatch(victim, hash, depth, old_data) && (old_data & 64)) g_hash_stats->overwrites[depth & 63]++; // A live entry of another key or depth goes. Empty slots and refreshes don't count
+#endif
+  const std::uint64_t data = HashData(nodes, depth);
+  victim->check.store(hash ^ data, std::memory_order_relaxed);
+  victim->data.store(data, std::memory_order_relaxed);
+}
+
+// Hash snapshots
+
+std::uint64_t ZobristDigest() { // A snapshot is only valid with the very same keys
+  std::uint64_t digest = 0xCBF29CE484222325ULL;
+  const auto mix = [&digest](const std::uint64_t *keys, const int n) {for (int i = 0; i < n; i++) digest = (digest ^ keys[i]) * 0x100000001B3ULL;};
+  mix(&kZobrist.board[0][0], 13 * 64);
+  mix(kZobrist.ep, 64);
+  mix(kZobrist.castle, 16);
+  mix(kZobrist.wtm, 2);
+  return digest;
+}
+
+HashHeader HashtableHeader() {
+  HashHeader header = {};
+  std::memcpy(header.magic, "LEMPHASH", 8);
+  header.format  = sizeof(MyHash) | ((sizeof(MyBucket) / sizeof(MyHash)) << 8) | (kHashFormat << 16);
+  header.zobrist = ZobristDigest();
+  header.buckets = g_hash_key + 1;
+  header.age     = g_hash_age;
+  return header;
+}
+
+bool WriteAll(const int fd, const void *data, std::size_t bytes) {
+  for (const char *ptr = (const char*) data; bytes; ) {
+    const ssize_t n = write(fd, ptr, bytes);
+    if (n <= 0) return false;
+    ptr += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+bool HashtableSave() { // On the main thread only, while helpers may still write: torn entries are saved as misses
+  if (g_hash_save.empty() || !g_hash_saver || !g_myhash) return true;
+  const HashHeader header = HashtableHeader();
+  const int fd = open(g_hash_save_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  const bool ok = WriteAll(fd, &header, sizeof(header)) && lseek(fd, kHashHeaderBytes, SEEK_SET) == kHashHeaderBytes && WriteAll(fd, g_myhash, header.buckets * sizeof(MyBucket));
+  return !close(fd) && ok && !rename(g_hash_save_tmp.c_str(), g_hash_save.c_str());
+}
+
+void HashtableSignal(const int signal) { // Any thread may get it, so the main thread saves
+  g_hash_signal = signal;
+}
+
+void HashtableSaveAndExit() {
+  if (!g_hash_saver) return;
+  HashtableSave();
+  _exit(128 + g_hash_signal);
+}
+
+inline void HashtableSignalCheck() { // Polled by the searchers: cheap until a signal came
+  if (g_hash_signal.load(std::memory_order_relaxed)) HashtableSaveAndExit();
+}
+
+bool HashtableLoad() { // Maps the snapshot copy-on-write: pages come in from disk as they are probed
+  if (g_hash_load.empty()) return false;
+  const HashHeader expected = HashtableHeader();
+  HashHeader header;
+  struct stat st;
+  const int fd = open(g_hash_load.c_str(), O_RDONLY);
+  Assert(fd >= 0, "Error #7: Can't open hash snapshot");
+  Assert(read(fd, &header, sizeof(header)) == sizeof(header) && !std::memcmp(header.magic, expected.magic, 8) && header.format == expected.format && header.zobrist == expected.zobrist, "Error #7: Incompatible hash snapshot");
+  Assert(header.buckets && !(header.buckets & (header.buckets - 1)) && !fstat(fd, &st) && (std::uint64_t) st.st_size >= kHashHeaderBytes + header.buckets * sizeof(MyBucket), "Error #7: Truncated hash snapshot");
+  HashtableFreeMemory();
+  g_hash_bytes = header.buckets * sizeof(MyBucket);
+  void *mem = mmap(0, g_hash_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, kHashHeaderBytes);
+  close(fd);
+  Assert(mem != MAP_FAILED, "Error #7: Can't map hash snapshot");
+  g_myhash   = (MyBucket*) mem;
+  g_hash_key = header.buckets - 1;
+  g_hash_age = header.age;
+  std::cout << "Hash: " << g_hash_load << " (" << (g_hash_bytes >> 20) << " MB)" << std::endl;
+  return true;
+}
+
+void HashtableSetup(const int hash_mb) {
+  if (!HashtableLoad()) HashtableSetSize(hash_mb);
+}
 
-void BuildBitboards() {
-  for (auto i = 0; i < 64; i++)
-    if (     g_board->pieces[i] > 0) g_board->white[ g_board->pieces[i] - 1] |= Bit(i);
-    else if (g_board->pieces[i] < 0) g_board->black[-g_board->pieces[i] - 1] |= Bit(i);
+void HashtableFinish() {
+  if (g_hash_save.empty()) return;
+  HashtableSignalCheck();
+  Assert(HashtableSave(), "Error #7: Can't save hash snapshot");
+  std::cout << "Hash: saved " << g_hash_save << std::endl;
 }
 
+// Board
+
 std::uint64_t Fill(int from, const int to) {
   std::uint64_t ret   = Bit(from);
   const int diff = from > to ? -1 : 1;
@@ -305,12 +831,8 @@ std::uint64_t Fill(int from, const int to) {
 }
 
 void FindKings() {
-  for (std::size_t i = 0; i < 64; i++) {
-    if (g_board->pieces[i] ==  6) 
-      g_king_w = i; 
-    else if (g_board->pieces[i] == -6) 
-      g_king_b = i;
-  }
+  if (g_board->white[5]) g_king_w = Ctz(g_board->white[5]);
+  if (g_board->black[5]) g_king_b = Ctz(g_board->black[5]);
 }
 
 void BuildCastlingBitboards() {
@@ -346,7 +868,7 @@ void FenBoard(const std::string fen) {
     else if (isdigit(fen[i])) 
       sq += fen[i] - '0'; 
     else 
-      g_board->pieces[sq++] = Piece(fen[i]);
+      PutPiece(Piece(fen[i]), sq++);
 }
 
 void FenKQkq(const std::string fen) {
@@ -366,9 +888,15 @@ void FenKQkq(const std::string fen) {
     }
 }
 
-void FenEp(const std::string fen) {
-  if (fen.length() != 2) return;
-  g_board->epsq = (fen[0] - 'a') + 8 * (fen[1] - '1');
+bool FenEpOk(const std::uint64_t *white, const std::uint64_t *black, const bool wtm, const int ep) { // Rank 6 (3), the pawn that just moved in front, its path empty
+  const int sign = wtm ? 1 : -1;
+  return Ycoord(ep) == (wtm ? 5 : 2) && ((wtm ? black[0] : white[0]) & Bit(ep - 8 * sign)) && !((white[6] | black[6]) & (Bit(ep) | Bit(ep + 8 * sign)));
+}
+
+void FenEp(const std::string fen) { // An impossible square is dropped: the e.p. capture would remove a pawn that isn't there
+  if (fen.length() != 2 || fen[0] < 'a' || fen[0] > 'h' || fen[1] < '1' || fen[1] > '8') return;
+  const int ep = (fen[0] - 'a') + 8 * (fen[1] - '1');
+  if (FenEpOk(g_board->white, g_board->black, g_wtm, ep)) g_board->epsq = ep;
 }
 
 void FenGen(const std::string fen) {
@@ -380,7 +908,7 @@ void FenGen(const std::string fen) {
   FindKings();
   FenKQkq(tokens[2]);
   BuildCastlingBitboards();
-  FenEp(tokens[3]);
+  FenEp(tokens.size() >= 4 ? tokens[3] : "-");
 }
 
 void FenReset() {
@@ -389,8 +917,6 @@ void FenReset() {
   g_wtm = 1;
   g_board->epsq = -1;
   g_king_w = g_king_b = 0;
-  std::memset(g_board->white, 0, sizeof(g_board->white));
-  std::memset(g_board->black, 0, sizeof(g_board->black));
   std::memset(g_rook_w, 0, sizeof(g_rook_w));
   std::memset(g_rook_b, 0, sizeof(g_rook_b));
 }
@@ -399,521 +925,1006 @@ void Fen(const std::string fen) {
   g_fen = fen;
   FenReset();
   FenGen(fen);
-  BuildBitboards();
+  g_board->hash = HashBoard();
   Assert(PopCount(g_board->white[5]) == 1 && PopCount(g_board->black[5]) == 1, "Error #2: Bad board");
 }
 
+struct Setup { // What a helper thread needs besides its boards
+  std::string fen;
+  int king_w, king_b, rook_w[2], rook_b[2];
+  bool wtm;
+  MyBucket *hash;
+  std::uint64_t hash_key;
+  std::size_t hash_bytes;
+  std::uint8_t hash_age;
+};
+
+Setup SaveSetup() {
+  return {g_fen, g_king_w, g_king_b, {g_rook_w[0], g_rook_w[1]}, {g_rook_b[0], g_rook_b[1]}, g_wtm, g_myhash, g_hash_key, g_hash_bytes, g_hash_age};
+}
+
+void LoadSetup(const Setup &setup) {
+  g_fen    = setup.fen;
+  g_king_w = setup.king_w;
+  g_king_b = setup.king_b;
+  std::memcpy(g_rook_w, setup.rook_w, sizeof(g_rook_w));
+  std::memcpy(g_rook_b, setup.rook_b, sizeof(g_rook_b));
+  g_wtm    = setup.wtm;
+  g_myhash     = setup.hash;
+  g_hash_key   = setup.hash_key;
+  g_hash_bytes = setup.hash_bytes;
+  g_hash_age   = setup.hash_age;
+  BuildCastlingBitboards();
+}
+
 // Checks
 
-bool ChecksHereW(const int square) {
-  const std::uint64_t both = Both();
-  return ((g_pawn_checks_b[square] & g_board->white[0]) 
-         | (g_knight_moves[square] & g_board->white[1]) 
-         | (BishopMagicMoves(square, both) & (g_board->white[2] | g_board->white[4])) 
-         | (RookMagicMoves(square, both) & (g_board->white[3] | g_board->white[4])) 
-         | (g_king_moves[square] & g_board->white[5]));
+inline std::uint64_t PawnChecksW(const std::uint64_t pawns) {
+  return ((pawns << 7) & ~0x8080808080808080ULL) | ((pawns << 9) & ~0x0101010101010101ULL);
 }
 
-bool ChecksHereB(const int square) {
-  const std::uint64_t both = Both();
-  return ((g_pawn_checks_w[square] & g_board->black[0]) 
-         | (g_knight_moves[square] & g_board->black[1]) 
-         | (BishopMagicMoves(square, both) & (g_board->black[2] | g_board->black[4])) 
-         | (RookMagicMoves(square, both) & (g_board->black[3] | g_board->black[4])) 
-         | (g_king_moves[square] & g_board->black[5]));
+inline std::uint64_t PawnChecksB(const std::uint64_t pawns) {
+  return ((pawns >> 9) & ~0x8080808080808080ULL) | ((pawns >> 7) & ~0x0101010101010101ULL);
 }
 
-bool ChecksCastleW(std::uint64_t squares) {
-  for (; squares; squares = ClearBit(squares)) {
-    if (ChecksHereW(Ctz(squares))) return true;
-  } 
-  return false;
+inline std::uint64_t Attacks(const std::uint64_t *you, const bool white, const std::uint64_t both) { // Every square 'you' attacks
+  std::uint64_t ret = (white ? PawnChecksW(you[0]) : PawnChecksB(you[0])) | kKingMoves[Ctz(you[5])];
+  for (std::uint64_t pieces = you[1]; pieces; pieces = ClearBit(pieces)) ret |= kKnightMoves[Ctz(pieces)];
+  for (std::uint64_t pieces = you[2] | you[4]; pieces; pieces = ClearBit(pieces)) ret |= BishopMagicMoves(Ctz(pieces), both);
+  for (std::uint64_t pieces = you[3] | you[4]; pieces; pieces = ClearBit(pieces)) ret |= RookMagicMoves(Ctz(pieces), both);
+  return ret;
 }
 
-bool ChecksCastleB(std::uint64_t squares) {
-  for (; squares; squares = ClearBit(squares)) {
-    if (ChecksHereB(Ctz(squares))) return true;
-  } 
-  return false;
+inline std::uint64_t Attackers(const std::uint64_t *you, const bool white, const int sq, const std::uint64_t both) { // 'you' pieces hitting sq
+  return ((white ? kPawnChecksB[sq] : kPawnChecksW[sq]) & you[0]) 
+         | (kKnightMoves[sq] & you[1]) 
+         | (BishopMagicMoves(sq, both) & (you[2] | you[4])) 
+         | (RookMagicMoves(sq, both) & (you[3] | you[4])) 
+         | (kKingMoves[sq] & you[5]);
+}
+
+inline void MgenLegal(const bool wtm) { // Checkers, enemy attacks, check evasion targets and pins. Once per node
+  const std::uint64_t *me = wtm ? g_board->white : g_board->black, *you = wtm ? g_board->black : g_board->white;
+  const std::uint64_t theirs = wtm ? g_black : g_white;
+  const int ksq = Ctz(me[5]);
+  g_checkers = Attackers(you, !wtm, ksq, g_both);
+  g_attacked = Attacks(you, !wtm, g_both ^ me[5]);
+  g_good     = ~(wtm ? g_white : g_black) & (g_checkers ? g_checkers | kBetween[ksq][Ctz(g_checkers)] : ~0ULL);
+  g_pinned   = 0;
+  for (std::uint64_t snipers = (RookMagicMoves(ksq, theirs) & (you[3] | you[4])) | (BishopMagicMoves(ksq, theirs) & (you[2] | you[4])); snipers; snipers = ClearBit(snipers)) {
+    const int sq = Ctz(snipers);
+    const std::uint64_t blockers = kBetween[ksq][sq] & g_both;
+    if (!(blockers & (blockers - 1)) && (blockers & ~theirs)) {
+      g_pinned |= blockers;
+      g_pin[Ctz(blockers)] = kBetween[ksq][sq] | Bit(sq);
+    }
+  }
 }
 
-inline bool ChecksW() {
-  return ChecksHereW(Ctz(g_board->black[5]));
+inline bool DoubleCheck() {
+  return g_checkers & (g_checkers - 1);
 }
 
-inline bool ChecksB() {
-  return ChecksHereB(Ctz(g_board->white[5]));
+inline std::uint64_t Good(const int sq) { // Legal targets of a non-king piece
+  return (g_pinned & Bit(sq)) ? g_good & g_pin[sq] : g_good;
 }
 
-// Move generator
+inline bool EpLegal(const bool wtm, const int from) { // Discovered checks: test the real position
+  const int cap = g_board->epsq + (wtm ? -8 : 8);
+  return !(Attackers(wtm ? g_board->black : g_board->white, !wtm, Ctz(wtm ? g_board->white[5] : g_board->black[5]), (g_both ^ Bit(from) ^ Bit(cap)) | Bit(g_board->epsq)) & ~Bit(cap));
+}
 
-#ifdef PEXT
+inline std::uint64_t EpPawns(const bool wtm) {
+  if (g_board->epsq <= 0 || !(Bit(g_board->epsq) & (wtm ? 0x0000FF0000000000ULL : 0x0000000000FF0000ULL))) return 0;
+  return wtm ? kPawnChecksB[g_board->epsq] & g_board->white[0] : kPawnChecksW[g_board->epsq] & g_board->black[0];
+}
 
-std::uint32_t Pext(const std::uint64_t occupied, const std::uint64_t mask) {
-  return _pext_u64(occupied, mask);
+inline bool EpCapturable(const Board *board, const bool wtm) { // Otherwise the ep square doesn't change the position
+  return board->epsq > 0 && (wtm ? kPawnChecksB[board->epsq] & board->white[0] : kPawnChecksW[board->epsq] & board->black[0]);
 }
 
-std::uint64_t BishopMagicMoves(const int sq, const std::uint64_t occupied) {
-  return g_bishop_magic_moves[sq][Pext(occupied, kBishopMask[square])];
+inline bool CastleLegal(const bool wtm, const int i) { // Path vs the attack map, then the king on its square (Chess960: the rook may have been the shield)
+  if (!(g_board->castle & (wtm ? 1 << i : 4 << i)) || ((wtm ? g_castle_empty_w[i] : g_castle_empty_b[i]) & g_both) || ((wtm ? g_castle_w[i] : g_castle_b[i]) & g_attacked)) return false;
+  const int ksq = wtm ? g_king_w : g_king_b, rook = wtm ? g_rook_w[i] : g_rook_b[i], kto = (wtm ? 0 : 56) + (i ? 2 : 6), rto = (wtm ? 0 : 56) + (i ? 3 : 5);
+  return !Attackers(wtm ? g_board->black : g_board->white, !wtm, kto, (g_both ^ Bit(ksq) ^ Bit(rook)) | Bit(kto) | Bit(rto));
 }
 
-std::uint64_t RookMagicMoves(const int sq, const std::uint64_t occupied) {
-  return g_rook_magic_moves[sq][Pext(occupied, kRookMask[square])];
+bool FenOk(const std::string &fen) { // Fen() trusts its input: the server and the library check first
+  std::vector<std::string> tokens = {};
+  std::uint64_t white[7] = {}, black[7] = {};
+  int rank = 7, file = 0;
+  Splitter<std::vector<std::string>>(fen, tokens, " ");
+  if (tokens.size() < 4 || (tokens[1] != "w" && tokens[1] != "b")) return false;
+  if (tokens[3] != "-" && (tokens[3].length() != 2 || tokens[3][0] < 'a' || tokens[3][0] > 'h' || (tokens[3][1] != '3' && tokens[3][1] != '6'))) return false;
+  for (const char c : tokens[0]) {
+    if (c == '/' && file == 8 && rank > 0) {rank--; file = 0;}
+    else if (c >= '1' && c <= '8') file += c - '0';
+    else if (Piece(c) && file < 8) (Piece(c) > 0 ? white : black)[std::abs(Piece(c)) - 1] |= Bit(8 * rank + file++);
+    else return false;
+    if (file > 8) return false;
+  }
+  for (int i = 0; i < 6; i++) {white[6] |= white[i]; black[6] |= black[i];}
+  if (rank || file != 8 || PopCount(white[5]) != 1 || PopCount(black[5]) != 1 || ((white[0] | black[0]) & 0xFF000000000000FFULL)) return false;
+  const bool wtm = tokens[1] == "w";
+  if (tokens[3] != "-" && !FenEpOk(white, black, wtm, (tokens[3][0] - 'a') + 8 * (tokens[3][1] - '1'))) return false;
+  if (Attackers(wtm ? white : black, wtm, Ctz(wtm ? black[5] : white[5]), white[6] | black[6])) return false; // The side to move could take the king
+  for (const char c : tokens[2]) { // Every right needs the king on its back rank and a rook on the named file
+    if (c == '-') continue;
+    const bool w = c >= 'A' && c <= 'Z';
+    const std::uint64_t *me = w ? white : black;
+    const int king = Ctz(me[5]), back = w ? 0 : 56, rook = (c == 'K' || c == 'k') ? 7 : (c == 'Q' || c == 'q') ? 0 : c - (w ? 'A' : 'a');
+    if (rook < 0 || rook > 7 || Ycoord(king) != (w ? 0 : 7) || rook == Xcoord(king) || !(me[3] & Bit(back + rook))) return false;
+  }
+  return true;
 }
 
-#else
+// Move generator
 
-constexpr std::uint64_t
-  kRookMagic[64] = {
-    0x548001400080106cULL,0x900184000110820ULL,0x428004200a81080ULL,0x140088082000c40ULL,0x1480020800011400ULL,0x100008804085201ULL,0x2a40220001048140ULL,0x50000810000482aULL,
-    0x250020100020a004ULL,0x3101880100900a00ULL,0x200a040a00082002ULL,0x1004300044032084ULL,0x2100408001013ULL,0x21f00440122083ULL,0xa204280406023040ULL,0x2241801020800041ULL,
-    0xe10100800208004ULL,0x2010401410080ULL,0x181482000208805ULL,0x4080101000021c00ULL,0xa250210012080022ULL,0x4210641044000827ULL,0x8081a02300d4010ULL,0x8008012000410001ULL,
-    0x28c0822120108100ULL,0x500160020aa005ULL,0xc11050088c1000ULL,0x48c00101000a288ULL,0x494a184408028200ULL,0x20880100240006ULL,0x10b4010200081ULL,0x40a200260000490cULL,
-    0x22384003800050ULL,0x7102001a008010ULL,0x80020c8010900c0ULL,0x100204082a001060ULL,0x8000118188800428ULL,0x58e0020009140244ULL,0x100145040040188dULL,0x44120220400980ULL,
-    0x114001007a00800ULL,0x80a0100516304000ULL,0x7200301488001000ULL,0x1000151040808018ULL,0x3000a200010e0020ULL,0x1000849180802810ULL,0x829100210208080ULL,0x1004050021528004ULL,
-    0x61482000c41820b0ULL,0x241001018a401a4ULL,0x45020c009cc04040ULL,0x308210c020081200ULL,0xa000215040040ULL,0x10a6024001928700ULL,0x42c204800c804408ULL,0x30441a28614200ULL,
-    0x40100229080420aULL,0x9801084000201103ULL,0x8408622090484202ULL,0x4022001048a0e2ULL,0x280120020049902ULL,0x1200412602009402ULL,0x914900048020884ULL,0x104824281002402ULL},
-  kBishopMagic[64] = {
-    0x2890208600480830ULL,0x324148050f087ULL,0x1402488a86402004ULL,0xc2210a1100044bULL,0x88450040b021110cULL,0xc0407240011ULL,0xd0246940cc101681ULL,0x1022840c2e410060ULL,
-    0x4a1804309028d00bULL,0x821880304a2c0ULL,0x134088090100280ULL,0x8102183814c0208ULL,0x518598604083202ULL,0x67104040408690ULL,0x1010040020d000ULL,0x600001028911902ULL,
-    0x8810183800c504c4ULL,0x2628200121054640ULL,0x28003000102006ULL,0x4100c204842244ULL,0x1221c50102421430ULL,0x80109046e0844002ULL,0xc128600019010400ULL,0x812218030404c38ULL,
-    0x1224152461091c00ULL,0x1c820008124000aULL,0xa004868015010400ULL,0x34c080004202040ULL,0x200100312100c001ULL,0x4030048118314100ULL,0x410000090018ULL,0x142c010480801ULL,
-    0x8080841c1d004262ULL,0x81440f004060406ULL,0x400a090008202ULL,0x2204020084280080ULL,0xb820060400008028ULL,0x110041840112010ULL,0x8002080a1c84400ULL,0x212100111040204aULL,
-    0x9412118200481012ULL,0x804105002001444cULL,0x103001280823000ULL,0x40088e028080300ULL,0x51020d8080246601ULL,0x4a0a100e0804502aULL,0x5042028328010ULL,0xe000808180020200ULL,
-    0x1002020620608101ULL,0x1108300804090c00ULL,0x180404848840841ULL,0x100180040ac80040ULL,0x20840000c1424001ULL,0x82c00400108800ULL,0x28c0493811082aULL,0x214980910400080cULL,
-    0x8d1a0210b0c000ULL,0x164c500ca0410cULL,0xc6040804283004ULL,0x14808001a040400ULL,0x180450800222a011ULL,0x600014600490202ULL,0x21040100d903ULL,0x10404821000420ULL};
+inline std::uint64_t Pext(const std::uint64_t occupied, const std::uint64_t mask) { // BMI2. Only reached when cpuid has it
+#if defined __BMI2__
+  return _pext_u64(occupied, mask);
+#elif defined __x86_64__
+  std::uint64_t ret;
+  asm ("pextq %2, %1, %0" : "=r" (ret) : "r" (occupied), "r" (mask));
+  return ret;
+#else
+  (void) occupied; (void) mask;
+  return 0;
+#endif
+}
 
-std::uint64_t BishopMagicIndex(const int sq, const std::uint64_t mask) {
-  return ((mask & kBishopMask[sq]) * kBishopMagic[sq]) >> 55;
+inline std::uint64_t BishopMagicIndex(const int sq, const std::uint64_t mask) { // PEXT or magic: both fit the square's 5 .. 9 mask bits
+  return g_pext ? Pext(mask, kBishopMask[sq]) : ((mask & kBishopMask[sq]) * kBishopMagic[sq]) >> kBishopShift[sq];
 }
 
-std::uint64_t RookMagicIndex(const int sq, const std::uint64_t mask) {
-  return ((mask & kRookMask[sq]) * kRookMagic[sq]) >> 52;
+inline std::uint64_t RookMagicIndex(const int sq, const std::uint64_t mask) { // 10 .. 12 bits
+  return g_pext ? Pext(mask, kRookMask[sq]) : ((mask & kRookMask[sq]) * kRookMagic[sq]) >> kRookShift[sq];
 }
 
-std::uint64_t BishopMagicMoves(const int sq, const std::uint64_t mask) {
+inline std::uint64_t BishopMagicMoves(const int sq, const std::uint64_t mask) {
   return g_bishop_magic_moves[sq][BishopMagicIndex(sq, mask)];
 }
 
-std::uint64_t RookMagicMoves(const int sq, const std::uint64_t mask) {
+inline std::uint64_t RookMagicMoves(const int sq, const std::uint64_t mask) {
   return g_rook_magic_moves[sq][RookMagicIndex(sq, mask)];
 }
 
-#endif
+inline Move MakeMove(const int from, const int to, const int flag = 0) {
+  return (Move) (from | (to << 6) | (flag << 12));
+}
 
-void HandleCastlingW(const int from, const int to) {
-  g_moves[g_moves_n] = *g_board;
-  g_board = &g_moves[g_moves_n];
-  g_board->epsq = -1;
-  g_board->from = from;
-  g_board->to = to;
-  g_board->castle &= 4 | 8;
-}
-
-void AddCastleOOW() {
-  if (ChecksCastleB(g_castle_w[0])) return;
-  HandleCastlingW(g_king_w, 6);
-  g_board->pieces[g_rook_w[0]] = 0;
-  g_board->pieces[g_king_w] = 0;
-  g_board->pieces[5] = 4;
-  g_board->pieces[6] = 6;
-  g_board->white[3] = (g_board->white[3] ^ Bit(g_rook_w[0])) | Bit(5);
-  g_board->white[5] = (g_board->white[5] ^ Bit(g_king_w))    | Bit(6);
-  if (ChecksB()) return;
-  g_moves_n++;
+void ListMoves(const bool wtm, const int from, std::uint64_t moves) { // Make/unmake: 16-bit moves instead of boards
+  if (!((wtm ? g_board->white[0] : g_board->black[0]) & Bit(from))) {
+    for (; moves; moves = ClearBit(moves)) g_move_list[g_moves_n++] = MakeMove(from, Ctz(moves));
+  } else if (Ycoord(from) == (wtm ? 6 : 1)) {
+    for (; moves; moves = ClearBit(moves)) 
+      for (int piece = 2; piece <= 5; piece++) g_move_list[g_moves_n++] = MakeMove(from, Ctz(moves), kMovePromo + piece - 2);
+  } else {
+    for (; moves; moves = ClearBit(moves)) g_move_list[g_moves_n++] = MakeMove(from, Ctz(moves), Ctz(moves) == g_board->epsq ? kMoveEp : 0);
+  }
 }
 
-void AddCastleOOOW() {
-  if (ChecksCastleB(g_castle_w[1])) return;
-  HandleCastlingW(g_king_w, 2);
-  g_board->pieces[g_rook_w[1]] = 0;
-  g_board->pieces[g_king_w] = 0;
-  g_board->pieces[3] = 4;
-  g_board->pieces[2] = 6;
-  g_board->white[3] = (g_board->white[3] ^ Bit(g_rook_w[1])) | Bit(3);
-  g_board->white[5] = (g_board->white[5] ^ Bit(g_king_w))    | Bit(2);
-  if (ChecksB()) return;
-  g_moves_n++;
+template <bool wtm> inline std::uint64_t *Mine(Board *board) {
+  return wtm ? board->white : board->black;
 }
 
-void MgenCastlingMovesW() {
-  if ((g_board->castle & 1) && !(g_castle_empty_w[0] & g_both)) {AddCastleOOW();  g_board = g_board_original;}
-  if ((g_board->castle & 2) && !(g_castle_empty_w[1] & g_both)) {AddCastleOOOW(); g_board = g_board_original;}
+template <bool wtm> inline std::uint64_t *Theirs(Board *board) {
+  return wtm ? board->black : board->white;
 }
 
-void HandleCastlingB(const int from, const int to) {
+template <bool wtm> void HandleCastling(const int from, const int to) { // to = the rook's square: king takes rook, never the name of a king step
   g_moves[g_moves_n] = *g_board;
   g_board = &g_moves[g_moves_n];
   g_board->epsq = -1;
   g_board->from = from;
   g_board->to = to;
-  g_board->castle &= 1 | 2;
-}
-
-void AddCastleOOB() {
-  if (ChecksCastleW(g_castle_b[0])) return;
-  HandleCastlingB(g_king_b, 56 + 6);
-  g_board->pieces[g_rook_b[0]] = 0;
-  g_board->pieces[g_king_b] = 0;
-  g_board->pieces[56 + 5] = -4;
-  g_board->pieces[56 + 6] = -6;
-  g_board->black[3] = (g_board->black[3] ^ Bit(g_rook_b[0])) | Bit(56 + 5);
-  g_board->black[5] = (g_board->black[5] ^ Bit(g_king_b))    | Bit(56 + 6);
-  if (ChecksW()) return;
-  g_moves_n++;
-}
-
-void AddCastleOOOB() {
-  if (ChecksCastleW(g_castle_b[1])) return;
-  HandleCastlingB(g_king_b, 56 + 2);
-  g_board->pieces[g_rook_b[1]] = 0;
-  g_board->pieces[g_king_b] = 0;
-  g_board->pieces[56 + 3] = -4;
-  g_board->pieces[56 + 2] = -6;
-  g_board->black[3] = (g_board->black[3] ^ Bit(g_rook_b[1])) | Bit(56 + 3);
-  g_board->black[5] = (g_board->black[5] ^ Bit(g_king_b))    | Bit(56 + 2);
-  if (ChecksW()) return;
+  g_board->castle &= wtm ? 4 | 8 : 1 | 2;
+}
+
+template <bool wtm> void AddCastle(const int i) { // 0: O-O, 1: O-O-O
+  constexpr int sign = wtm ? 1 : -1, base = wtm ? 0 : 56;
+  const int king = wtm ? g_king_w : g_king_b, rook = wtm ? g_rook_w[i] : g_rook_b[i], kto = base + (i ? 2 : 6), rto = base + (i ? 3 : 5);
+  HandleCastling<wtm>(king, rook);
+  std::uint64_t *me = Mine<wtm>(g_board);
+  me[3] = (me[3] ^ Bit(rook)) | Bit(rto);
+  me[5] = (me[5] ^ Bit(king)) | Bit(kto);
+  me[6] = (me[6] ^ Bit(rook) ^ Bit(king)) | Bit(rto) | Bit(kto);
+  HashMove(6 * sign, king, kto);
+  HashMove(4 * sign, rook, rto);
+  HashState();
   g_moves_n++;
 }
 
-void MgenCastlingMovesB() {
-  if ((g_board->castle & 4) && !(g_castle_empty_b[0] & g_both)) {AddCastleOOB();  g_board = g_board_original;}
-  if ((g_board->castle & 8) && !(g_castle_empty_b[1] & g_both)) {AddCastleOOOB(); g_board = g_board_original;}
-}
-
-void CheckCastlingRightsW() {
-  if (g_board->pieces[g_king_w]    != 6) {g_board->castle &= 4 | 8; return;}
-  if (g_board->pieces[g_rook_w[0]] != 4) {g_board->castle &= 2 | 4 | 8;}
-  if (g_board->pieces[g_rook_w[1]] != 4) {g_board->castle &= 1 | 4 | 8;}
+template <bool wtm> void MgenCastlingMoves() {
+  if (g_move_list) {
+    if (CastleLegal(wtm, 0)) g_move_list[g_moves_n++] = MakeMove(wtm ? g_king_w : g_king_b, wtm ? 6 : 56 + 6, kMoveOO);
+    if (CastleLegal(wtm, 1)) g_move_list[g_moves_n++] = MakeMove(wtm ? g_king_w : g_king_b, wtm ? 2 : 56 + 2, kMoveOOO);
+    return;
+  }
+  if (CastleLegal(wtm, 0)) {AddCastle<wtm>(0); g_board = g_board_original;}
+  if (CastleLegal(wtm, 1)) {AddCastle<wtm>(1); g_board = g_board_original;}
 }
 
-void CheckCastlingRightsB() {
-  if (g_board->pieces[g_king_b]    != -6) {g_board->castle &= 1 | 2; return;}
-  if (g_board->pieces[g_rook_b[0]] != -4) {g_board->castle &= 1 | 2 | 8;}
-  if (g_board->pieces[g_rook_b[1]] != -4) {g_board->castle &= 1 | 2 | 4;}
+template <bool wtm> void CheckCastlingRights() {
+  const std::uint64_t *me = Mine<wtm>(g_board);
+  if (!(me[5] & Bit(wtm ? g_king_w : g_king_b)))       {g_board->castle &= wtm ? 4 | 8 : 1 | 2; return;}
+  if (!(me[3] & Bit(wtm ? g_rook_w[0] : g_rook_b[0]))) {g_board->castle &= wtm ? 2 | 4 | 8 : 1 | 2 | 8;}
+  if (!(me[3] & Bit(wtm ? g_rook_w[1] : g_rook_b[1]))) {g_board->castle &= wtm ? 1 | 4 | 8 : 1 | 2 | 4;}
 }
 
 void HandleCastlingRights() {
   if (!g_board->castle) return;
-  CheckCastlingRightsW();
-  CheckCastlingRightsB();
+  CheckCastlingRights<true>();
+  CheckCastlingRights<false>();
 }
 
-void ModifyPawnStuffW(const int from, const int to) {
+template <bool wtm> void ModifyPawnStuff(const int from, const int to) {
+  constexpr int sign = wtm ? 1 : -1;
   if (to == g_board_original->epsq) {
-    g_board->pieces[to - 8] = 0;
-    g_board->black[0] ^= Bit(to - 8);
-  } else if (Ycoord(to) - Ycoord(from) == 2) {
-    g_board->epsq = to - 8;
+    Theirs<wtm>(g_board)[0] ^= Bit(to - 8 * sign);
+    Theirs<wtm>(g_board)[6] ^= Bit(to - 8 * sign);
+    HashPiece(-sign, to - 8 * sign);
+  } else if (Ycoord(to) - Ycoord(from) == 2 * sign) {
+    g_board->epsq = to - 8 * sign;
   }
 }
 
-void AddPromotionW(const int from, const int to, const int piece) {
-  const int eat = g_board->pieces[to];
+template <bool wtm> void AddPromotion(const int from, const int to, const int piece) { // piece 2..5
+  constexpr int sign = wtm ? 1 : -1;
+  const int eat = PieceOf(Theirs<wtm>(g_board), to);
   g_moves[g_moves_n] = *g_board;
   g_board = &g_moves[g_moves_n];
-  g_board->from        = from;
-  g_board->to          = to;
-  g_board->epsq        = -1;
-  g_board->pieces[to]   = piece;
-  g_board->pieces[from] = 0;
-  g_board->white[0]   ^= Bit(from);
-  g_board->white[piece - 1] |= Bit(to);
-  if (eat <= -1) g_board->black[-eat - 1] ^= Bit(to);
-  if (ChecksB()) return;
+  std::uint64_t *me = Mine<wtm>(g_board), *you = Theirs<wtm>(g_board);
+  g_board->from       = from;
+  g_board->to         = to;
+  g_board->epsq       = -1;
+  me[0]              ^= Bit(from);
+  me[piece - 1]      |= Bit(to);
+  me[6]               = (me[6] ^ Bit(from)) | Bit(to);
+  if (eat) {you[eat - 1] ^= Bit(to); you[6] ^= Bit(to);}
   HandleCastlingRights();
+  HashPiece(sign, from);
+  HashPiece(sign * piece, to);
+  if (eat) HashPiece(-sign * eat, to);
+  HashState();
   g_moves_n++;
 }
 
-void AddNormalStuffW(const int from, const int to) {
-  const int me = g_board->pieces[from], eat = g_board->pieces[to];
-  if (me <= 0) return;
+template <bool wtm> void AddNormalStuff(const int from, const int to) {
+  constexpr int sign = wtm ? 1 : -1;
+  const int me = PieceOf(Mine<wtm>(g_board), from), eat = PieceOf(Theirs<wtm>(g_board), to);
+  if (!me) return;
   g_moves[g_moves_n] = *g_board;
   g_board = &g_moves[g_moves_n];
-  g_board->from          = from;
-  g_board->to            = to;
-  g_board->epsq          = -1;
-  g_board->pieces[from]   = 0;
-  g_board->pieces[to]     = me;
-  g_board->white[me - 1] = (g_board->white[me - 1] ^ Bit(from)) | Bit(to);
-  if (eat <= -1) g_board->black[-eat - 1] ^= Bit(to);
-  if (g_board->pieces[to] == 1) ModifyPawnStuffW(from, to);
-  if (ChecksB()) return;
+  std::uint64_t *mine = Mine<wtm>(g_board), *you = Theirs<wtm>(g_board);
+  g_board->from   = from;
+  g_board->to     = to;
+  g_board->epsq   = -1;
+  mine[me - 1]    = (mine[me - 1] ^ Bit(from)) | Bit(to);
+  mine[6]         = (mine[6] ^ Bit(from)) | Bit(to);
+  if (eat) {you[eat - 1] ^= Bit(to); you[6] ^= Bit(to);}
+  if (me == 1) ModifyPawnStuff<wtm>(from, to);
   HandleCastlingRights();
+  HashMove(sign * me, from, to);
+  if (eat) HashPiece(-sign * eat, to);
+  HashState();
   g_moves_n++;
 }
 
-void AddPromotionStuffW(const int from, const int to) {
-  Board *tmp = g_board; 
+template <bool wtm> void AddPromotionStuff(const int from, const int to) {
+  Board *tmp = g_board;
   for (int piece = 2; piece <= 5; piece++) {
-    AddPromotionW(from, to, piece); 
+    AddPromotion<wtm>(from, to, piece);
     g_board = tmp;
-  } 
+  }
 }
 
-void AddW(const int from, const int to) {
-  if (g_board->pieces[from] == 1 && Ycoord(from) == 6) 
-    AddPromotionStuffW(from, to); 
-  else 
-    AddNormalStuffW(from, to);
+template <bool wtm> void Add(const int from, const int to) {
+  if ((Mine<wtm>(g_board)[0] & Bit(from)) && Ycoord(from) == (wtm ? 6 : 1))
+    AddPromotionStuff<wtm>(from, to);
+  else
+    AddNormalStuff<wtm>(from, to);
 }
 
-void AddMovesW(const int from, std::uint64_t moves) {
+template <bool wtm> void AddMoves(const int from, std::uint64_t moves) {
+  if (g_move_list) {
+    ListMoves(wtm, from, moves);
+    return;
+  }
   for (; moves; moves = ClearBit(moves)) {
-    AddW(from, Ctz(moves)); 
+    Add<wtm>(from, Ctz(moves));
     g_board = g_board_original;
   }
 }
 
-void ModifyPawnStuffB(const int from, const int to) {
-  if (to == g_board_original->epsq) {
-    g_board->pieces[to + 8] = 0;
-    g_board->white[0] ^= Bit(to + 8);
-  } else if (Ycoord(to) - Ycoord(from) == -2) {
-    g_board->epsq = to + 8;
-  }
+template <bool wtm> void MgenSetup() {
+  g_white   = White();
+  g_black   = Black();
+  g_both    = g_white | g_black;
+  g_empty   = ~g_both;
+  MgenLegal(wtm);
 }
 
-void AddNormalStuffB(const int from, const int to) {
-  const int me = g_board->pieces[from], eat = g_board->pieces[to];
-  if (me >= 0) return;
-  g_moves[g_moves_n] = *g_board;
-  g_board                 = &g_moves[g_moves_n];
-  g_board->from           = from;
-  g_board->to             = to;
-  g_board->epsq           = -1;
-  g_board->pieces[to]      = me;
-  g_board->pieces[from]    = 0;
-  g_board->black[-me - 1] = (g_board->black[-me - 1] ^ Bit(from)) | Bit(to);
-  if (eat >= 1) g_board->white[eat - 1] ^= Bit(to);
-  if (g_board->pieces[to] == -1) ModifyPawnStuffB(from, to);
-  if (ChecksW()) return;
-  HandleCastlingRights();
-  g_moves_n++;
+template <bool wtm> void MgenPawns() {
+  for (std::uint64_t pieces = Mine<wtm>(g_board)[0]; pieces; pieces = ClearBit(pieces)) {
+    const auto sq = Ctz(pieces);
+    const std::uint64_t good = Good(sq);
+    AddMoves<wtm>(sq, (wtm ? kPawnChecksW[sq] & g_black : kPawnChecksB[sq] & g_white) & good);
+    if (Ycoord(sq) == (wtm ? 1 : 6)) {
+      if ((wtm ? kPawn1MovesW[sq] : kPawn1MovesB[sq]) & g_empty) AddMoves<wtm>(sq, (wtm ? kPawn2MovesW[sq] : kPawn2MovesB[sq]) & g_empty & good);
+    } else {
+      AddMoves<wtm>(sq, (wtm ? kPawn1MovesW[sq] : kPawn1MovesB[sq]) & g_empty & good);
+    }
+  }
+  for (std::uint64_t pieces = EpPawns(wtm); pieces; pieces = ClearBit(pieces)) {
+    if (EpLegal(wtm, Ctz(pieces))) AddMoves<wtm>(Ctz(pieces), Bit(g_board->epsq));
+  }
 }
 
-void AddPromotionB(const int from, const int to, const int piece) {
-  const int eat = g_board->pieces[to];
-  g_moves[g_moves_n] = *g_board;
-  g_board = &g_moves[g_moves_n];
-  g_board->from        = from;
-  g_board->to          = to;
-  g_board->epsq        = -1;
-  g_board->pieces[from] = 0;
-  g_board->pieces[to]   = piece;
-  g_board->black[0]   ^= Bit(from);
-  g_board->black[-piece - 1] |= Bit(to);
-  if (eat >= 1) g_board->white[eat - 1] ^= Bit(to);
-  if (ChecksW()) return;
-  HandleCastlingRights();
-  g_moves_n++;
+template <bool wtm> void MgenKnights() {
+  for (std::uint64_t pieces = Mine<wtm>(g_board)[1] & ~g_pinned; pieces; pieces = ClearBit(pieces)) {
+    const auto sq = Ctz(pieces);
+    AddMoves<wtm>(sq, kKnightMoves[sq] & g_good);
+  }
 }
 
-void AddPromotionStuffB(const int from, const int to) {
-  Board *tmp = g_board; 
-  for (int piece = 2; piece <= 5; piece++) {
-    AddPromotionB(from, to, -piece); 
-    g_board = tmp;
+template <bool wtm> void MgenBishopsPlusQueens() {
+  for (std::uint64_t pieces = Mine<wtm>(g_board)[2] | Mine<wtm>(g_board)[4]; pieces; pieces = ClearBit(pieces)) {
+    const auto sq = Ctz(pieces);
+    AddMoves<wtm>(sq, BishopMagicMoves(sq, g_both) & Good(sq));
   }
 }
 
-void AddB(const int from, const int to) {
-  if (g_board->pieces[from] == -1 && Ycoord(from) == 1) 
-    AddPromotionStuffB(from, to); 
-  else 
-    AddNormalStuffB(from, to);
+template <bool wtm> void MgenRooksPlusQueens() {
+  for (std::uint64_t pieces = Mine<wtm>(g_board)[3] | Mine<wtm>(g_board)[4]; pieces; pieces = ClearBit(pieces)) {
+    const auto sq = Ctz(pieces);
+    AddMoves<wtm>(sq, RookMagicMoves(sq, g_both) & Good(sq));
+  }
 }
 
-void AddMovesB(const int from, std::uint64_t moves) {
-  for (; moves; moves = ClearBit(moves)) {
-    AddB(from, Ctz(moves)); 
-    g_board = g_board_original;
+template <bool wtm> void MgenKing() {
+  const auto sq = Ctz(Mine<wtm>(g_board)[5]);
+  AddMoves<wtm>(sq, kKingMoves[sq] & ~(wtm ? g_white : g_black) & ~g_attacked);
+}
+
+template <bool wtm> void MgenAll() {
+  MgenSetup<wtm>();
+  if (DoubleCheck()) {
+    MgenKing<wtm>();
+    return;
   }
+  MgenPawns<wtm>();
+  MgenKnights<wtm>();
+  MgenBishopsPlusQueens<wtm>();
+  MgenRooksPlusQueens<wtm>();
+  MgenKing<wtm>();
+  MgenCastlingMoves<wtm>();
 }
 
-void MgenSetupW() {
-  g_white   = White();
-  g_black   = Black();
-  g_both    = g_white | g_black;
-  g_empty   = ~g_both;
-  g_pawn_sq = g_board->epsq > 0 ? g_black | (Bit(g_board->epsq) & 0x0000FF0000000000ULL) : g_black;
+template <bool wtm> int Mgen(Board *moves) {
+  g_moves_n = 0;
+  g_moves = moves;
+  g_board_original = g_board;
+  MgenAll<wtm>();
+
+  return g_moves_n;
 }
 
-void MgenSetupB() {
-  g_white   = White();
-  g_black   = Black();
-  g_both    = g_white | g_black;
-  g_empty   = ~g_both;
-  g_pawn_sq = g_board->epsq > 0 ? g_white | (Bit(g_board->epsq) & 0x0000000000FF0000ULL) : g_white;
+int MgenBoards(const bool wtm, Board *moves) { // Copy-make: one child board per legal move
+  return wtm ? Mgen<true>(moves) : Mgen<false>(moves);
 }
 
-void MgenPawnsW() {
-  for (std::uint64_t pieces = g_board->white[0]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces);
-    AddMovesW(sq, g_pawn_checks_w[sq] & g_pawn_sq);
-    if (Ycoord(sq) == 1) {
-      if (g_pawn_1_moves_w[sq] & g_empty) AddMovesW(sq, g_pawn_2_moves_w[sq] & g_empty);
+int MgenMoves(const bool wtm, Move *moves) {
+  g_moves_n = 0;
+  g_move_list = moves;
+  g_board_original = g_board;
+  if (wtm) MgenAll<true>(); else MgenAll<false>();
+  g_move_list = 0;
+
+  return g_moves_n;
+}
+
+// Make / unmake
+
+inline void MovePiece(const int piece, const int from, const int to) { // Bitboards, occupancy and hash
+  std::uint64_t *side = piece > 0 ? g_board->white : g_board->black;
+  side[std::abs(piece) - 1] ^= Bit(from) ^ Bit(to);
+  side[6] ^= Bit(from) ^ Bit(to);
+  HashMove(piece, from, to);
+}
+
+inline void FlipPiece(const int piece, const int sq) {
+  std::uint64_t *side = piece > 0 ? g_board->white : g_board->black;
+  side[std::abs(piece) - 1] ^= Bit(sq);
+  side[6] ^= Bit(sq);
+  HashPiece(piece, sq);
+}
+
+inline void CastleSquares(const bool wtm, const Move move, int &king, int &rook, int &kto, int &rto) {
+  const int i = (move >> 12) - kMoveOO;
+  king = wtm ? g_king_w : g_king_b;
+  rook = wtm ? g_rook_w[i] : g_rook_b[i];
+  kto  = (move >> 6) & 63;
+  rto  = kto + (i ? 1 : -1);
+}
+
+inline void DoMove(const bool wtm, const Move move, Undo &undo) {
+  const int from = move & 63, to = (move >> 6) & 63, flag = move >> 12, sign = wtm ? 1 : -1;
+  undo = {g_board->hash, (std::int8_t) (-sign * PieceOf(wtm ? g_board->black : g_board->white, to)), g_board->epsq, g_board->castle};
+  g_board->hash ^= kZobrist.ep[g_board->epsq + 1] ^ kZobrist.castle[g_board->castle];
+  g_board->epsq = -1;
+
+  if (flag == kMoveOO || flag == kMoveOOO) {
+    int king, rook, kto, rto;
+    CastleSquares(wtm, move, king, rook, kto, rto);
+    MovePiece(6 * sign, king, kto);
+    MovePiece(4 * sign, rook, rto);
+    g_board->castle &= wtm ? 4 | 8 : 1 | 2;
+  } else {
+    const int me = sign * PieceOf(wtm ? g_board->white : g_board->black, from), eat = undo.eat, piece = flag >= kMovePromo ? sign * (flag - kMovePromo + 2) : me;
+    if (eat) FlipPiece(eat, to);
+    if (piece == me) {
+      MovePiece(me, from, to);
     } else {
-      AddMovesW(sq, g_pawn_1_moves_w[sq] & g_empty);
+      FlipPiece(me, from);
+      FlipPiece(piece, to);
     }
+    if (flag == kMoveEp) {
+      FlipPiece(-sign, to - 8 * sign);
+    } else if (me == sign && std::abs(to - from) == 16) {
+      g_board->epsq = (from + to) / 2;
+    }
+    HandleCastlingRights();
   }
+
+  g_board->hash ^= kZobrist.ep[g_board->epsq + 1] ^ kZobrist.castle[g_board->castle];
 }
 
-void MgenPawnsB() {
-  for (std::uint64_t pieces = g_board->black[0]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces);
-    AddMovesB(sq, g_pawn_checks_b[sq] & g_pawn_sq);
-    if (Ycoord(sq) == 6) {
-      if (g_pawn_1_moves_b[sq] & g_empty) AddMovesB(sq, g_pawn_2_moves_b[sq] & g_empty);
+inline void UndoMove(const bool wtm, const Move move, const Undo &undo) {
+  const int from = move & 63, to = (move >> 6) & 63, flag = move >> 12, sign = wtm ? 1 : -1;
+
+  if (flag == kMoveOO || flag == kMoveOOO) {
+    int king, rook, kto, rto;
+    CastleSquares(wtm, move, king, rook, kto, rto);
+    MovePiece(6 * sign, king, kto);
+    MovePiece(4 * sign, rook, rto);
+  } else {
+    const int piece = sign * PieceOf(wtm ? g_board->white : g_board->black, to), me = flag >= kMovePromo ? sign : piece;
+    if (undo.eat) FlipPiece(undo.eat, to);
+    if (piece == me) {
+      MovePiece(me, from, to);
     } else {
-      AddMovesB(sq, g_pawn_1_moves_b[sq] & g_empty);
+      FlipPiece(me, from);
+      FlipPiece(piece, to);
+    }
+    if (flag == kMoveEp) {
+      FlipPiece(-sign, to - 8 * sign);
     }
   }
+
+  g_board->hash   = undo.hash;
+  g_board->epsq   = undo.epsq;
+  g_board->castle = undo.castle;
 }
 
-void MgenKnightsW() {
-  for (std::uint64_t pieces = g_board->white[1]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces); 
-    AddMovesW(sq, g_knight_moves[sq] & g_good);
+// Counting
+
+template <bool wtm> inline int CountMoves() { // Legal moves from target bitboards. No boards are written
+  const std::uint64_t *me = Mine<wtm>(g_board);
+  const int ksq = Ctz(me[5]);
+  int count = PopCount(kKingMoves[ksq] & ~(wtm ? g_white : g_black) & ~g_attacked);
+
+  if (DoubleCheck()) 
+    return count;
+
+  for (std::uint64_t pieces = me[0]; pieces; pieces = ClearBit(pieces)) {
+    const auto sq = Ctz(pieces);
+    const std::uint64_t one = (wtm ? kPawn1MovesW[sq] : kPawn1MovesB[sq]) & g_empty;
+    std::uint64_t moves = ((wtm ? kPawnChecksW[sq] & g_black : kPawnChecksB[sq] & g_white)) | one;
+    if (one && Ycoord(sq) == (wtm ? 1 : 6)) moves |= (wtm ? kPawn2MovesW[sq] : kPawn2MovesB[sq]) & g_empty;
+    count += PopCount(moves & Good(sq)) << (Ycoord(sq) == (wtm ? 6 : 1) ? 2 : 0);
   }
-}
 
-void MgenKnightsB() {
-  for (std::uint64_t pieces = g_board->black[1]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces); 
-    AddMovesB(sq, g_knight_moves[sq] & g_good);
+  for (std::uint64_t pieces = EpPawns(wtm); pieces; pieces = ClearBit(pieces)) 
+    count += EpLegal(wtm, Ctz(pieces));
+
+  for (std::uint64_t pieces = me[1] & ~g_pinned; pieces; pieces = ClearBit(pieces)) 
+    count += PopCount(kKnightMoves[Ctz(pieces)] & g_good);
+
+  for (std::uint64_t pieces = me[2] | me[4]; pieces; pieces = ClearBit(pieces)) {
+    const auto sq = Ctz(pieces);
+    count += PopCount(BishopMagicMoves(sq, g_both) & Good(sq));
   }
-}
 
-void MgenBishopsPlusQueensW() {
-  for (std::uint64_t pieces = g_board->white[2] | g_board->white[4]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces); 
-    AddMovesW(sq, BishopMagicMoves(sq, g_both) & g_good);
+  for (std::uint64_t pieces = me[3] | me[4]; pieces; pieces = ClearBit(pieces)) {
+    const auto sq = Ctz(pieces);
+    count += PopCount(RookMagicMoves(sq, g_both) & Good(sq));
   }
+
+  if (!g_checkers && (g_board->castle & (wtm ? 1 | 2 : 4 | 8))) 
+    count += CastleLegal(wtm, 0) + CastleLegal(wtm, 1);
+
+  return count;
 }
 
-void MgenBishopsPlusQueensB() {
-  for (std::uint64_t pieces = g_board->black[2] | g_board->black[4]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces); 
-    AddMovesB(sq, BishopMagicMoves(sq, g_both) & g_good);
-  }
+template <bool wtm> int Count() {
+  MgenSetup<wtm>();
+  return CountMoves<wtm>();
 }
 
-void MgenRooksPlusQueensW() {
-  for (std::uint64_t pieces = g_board->white[3] | g_board->white[4]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces); 
-    AddMovesW(sq, RookMagicMoves(sq, g_both) & g_good);
-  }
+// Batch (leaf counts of sibling boards, one board per SIMD lane)
+
+typedef std::uint64_t BatchLanes4 __attribute__((vector_size(32))); // AVX2
+typedef std::uint64_t BatchLanes8 __attribute__((vector_size(64))); // AVX-512
+
+// Vectors only travel by reference: by value they'd change the ABI of the portable build (-Wpsabi)
+
+template <int d> constexpr std::uint64_t kBatchWrap = // Squares a step towards d can land on: 1 = east, 8 = north, 17 = knight
+  ((d % 8 + 8) % 8) == 1 ? 0xFEFEFEFEFEFEFEFEULL : ((d % 8 + 8) % 8) == 2 ? 0xFCFCFCFCFCFCFCFCULL :
+  ((d % 8 + 8) % 8) == 6 ? 0x3F3F3F3F3F3F3F3FULL : ((d % 8 + 8) % 8) == 7 ? 0x7F7F7F7F7F7F7F7FULL : ~0ULL;
+
+template <int d, class V> [[gnu::always_inline]] inline V &BatchStep(V &ret, const V &x) {
+  if constexpr (d > 0) ret = x << d;
+  else ret = x >> -d;
+  return ret;
 }
 
-void MgenRooksPlusQueensB() {
-  for (std::uint64_t pieces = g_board->black[3] | g_board->black[4]; pieces; pieces = ClearBit(pieces)) {
-    const auto sq = Ctz(pieces); 
-    AddMovesB(sq, RookMagicMoves(sq, g_both) & g_good);
-  }
+template <int d, class V> [[gnu::always_inline]] inline V &BatchShift(V &ret, const V &x) {
+  return BatchStep<d>(ret, x) &= kBatchWrap<d>;
 }
 
-void MgenKingW() {
-  const auto sq = Ctz(g_board->white[5]); 
-  AddMovesW(sq, g_king_moves[sq] & g_good);
+template <int d, class V> [[gnu::always_inline]] inline V &BatchRay(V &ret, const V &from, const V &through) { // Kogge-Stone: slider attacks from towards d. First blocker included
+  V gen = from, pro = through & kBatchWrap<d>, step;
+  gen |= pro & BatchStep<d>(step, gen);
+  pro &= BatchStep<d>(step, pro);
+  gen |= pro & BatchStep<2 * d>(step, gen);
+  pro &= BatchStep<2 * d>(step, pro);
+  gen |= pro & BatchStep<4 * d>(step, gen);
+  return BatchShift<d>(ret, gen);
 }
 
-void MgenKingB() {
-  const auto sq = Ctz(g_board->black[5]); 
-  AddMovesB(sq, g_king_moves[sq] & g_good);
+template <int... d, class V> [[gnu::always_inline]] inline void BatchRays(V &ret, const V &from, const V &through) { // ret |= rays
+  V ray;
+  ((ret |= BatchRay<d>(ray, from, through)), ...);
 }
 
-void MgenAllW() {
-  MgenSetupW();
-  g_good = ~g_white;
-  MgenPawnsW();
-  MgenKnightsW();
-  MgenBishopsPlusQueensW();
-  MgenRooksPlusQueensW();
-  MgenKingW();
-  MgenCastlingMovesW();
+template <int... d, class V> [[gnu::always_inline]] inline void BatchShifts(V &ret, const V &x) { // ret |= shifts
+  V shift;
+  ((ret |= BatchShift<d>(shift, x)), ...);
 }
 
-void MgenAllB() {
-  MgenSetupB();
-  g_good = ~g_black;
-  MgenPawnsB();
-  MgenKnightsB();
-  MgenBishopsPlusQueensB();
-  MgenRooksPlusQueensB();
-  MgenKingB();
-  MgenCastlingMovesB();
+template <class V> [[gnu::always_inline]] inline void BatchPopCount(V &count, const V &x) { // vpopcntq where the CPU has it
+  for (std::size_t i = 0; i < sizeof(V) / 8; i++) count[i] += PopCount(x[i]);
 }
 
-int MgenW(Board *moves) {
-  g_moves_n = 0;
-  g_moves = moves;
-  g_board_original = g_board;
-  MgenAllW();
+template <int... d, class V> [[gnu::always_inline]] inline void BatchCountShifts(V &count, const V &x, const V &good) { // Each shift moves every piece to a different square
+  V shift;
+  (BatchPopCount(count, BatchShift<d>(shift, x) & good), ...);
+}
 
-  return g_moves_n;
+template <int... d, class V> [[gnu::always_inline]] inline void BatchCountRays(V &count, const V &x, const V &good, const V &empty) { // Rays of 2 pieces towards d only meet on our own pieces
+  V ray;
+  (BatchPopCount(count, BatchRay<d>(ray, x, empty) & good), ...);
 }
 
-int MgenB(Board *moves) {
-  g_moves_n = 0;
-  g_moves = moves;
-  g_board_original = g_board;
-  MgenAllB();
+template <int... d, class V> [[gnu::always_inline]] inline void BatchPins(V &pinned, const V &king, const V &sliders, const V &mine, const V &empty, V &checkers, V &between) { // pinned |= the pieces pinned towards d
+  V ray, behind;
+  ((BatchRay<d>(ray, king, empty),
+    checkers |= ray & ~empty & sliders,
+    between  |= ray & empty & (V) ((ray & ~empty & sliders) != 0),
+    pinned   |= ray & ~empty & mine & (V) ((BatchRay<d>(behind, ray & ~empty & mine, empty) & sliders) != 0)), ...);
+}
 
-  return g_moves_n;
+template <bool wtm, class V> [[gnu::always_inline]] inline void BatchKernel(const Board *const *boards, int *counts) { // CountMoves<wtm>() of every lane, set-wise
+  constexpr int lanes = sizeof(V) / 8, up = wtm ? 8 : -8, left = wtm ? 7 : -9, right = wtm ? 9 : -7;
+  constexpr std::uint64_t rank3 = wtm ? 0xFF0000ULL : 0xFF0000000000ULL, rank8 = wtm ? 0xFF00000000000000ULL : 0xFFULL;
+  V me[7], you[7], castle;
+  for (int i = 0; i < lanes; i++) {
+    for (int j = 0; j < 7; j++) {
+      me[j][i]  = wtm ? boards[i]->white[j] : boards[i]->black[j];
+      you[j][i] = wtm ? boards[i]->black[j] : boards[i]->white[j];
+    }
+    castle[i] = boards[i]->castle;
+  }
+
+  const V empty = ~(me[6] | you[6]), king = me[5], diag = you[2] | you[4], orth = you[3] | you[4];
+  V attacked = {}, pawn_checks = {}, knight_checks = {};
+  BatchShifts<up == 8 ? -7 : 7, up == 8 ? -9 : 9>(attacked, you[0]);
+  BatchShifts<17, 15, 10, 6, -6, -10, -15, -17>(attacked, you[1]);
+  BatchShifts<1, 9, 8, 7, -1, -9, -8, -7>(attacked, you[5]);
+  BatchRays<9, 7, -7, -9>(attacked, diag, empty | king); // Our king doesn't shield the squares behind it
+  BatchRays<8, 1, -1, -8>(attacked, orth, empty | king);
+  BatchShifts<left, right>(pawn_checks, king);
+  BatchShifts<17, 15, 10, 6, -6, -10, -15, -17>(knight_checks, king);
+  V checkers = (pawn_checks & you[0]) | (knight_checks & you[1]), between = {}, pin[4] = {}; // [file, rank, a1-h8, h1-a8]
+  BatchPins<8, -8>(pin[0], king, orth, me[6], empty, checkers, between);
+  BatchPins<1, -1>(pin[1], king, orth, me[6], empty, checkers, between);
+  BatchPins<9, -9>(pin[2], king, diag, me[6], empty, checkers, between);
+  BatchPins<7, -7>(pin[3], king, diag, me[6], empty, checkers, between);
+  const V pinned = pin[0] | pin[1] | pin[2] | pin[3], free = ~pinned;
+  const V good = ~me[6] & (checkers | between | (V) (checkers == 0)) & (V) ((checkers & (checkers - 1)) == 0); // Nothing but the king in double check
+
+  V count = {}, steps = {};
+  BatchShifts<1, 9, 8, 7, -1, -9, -8, -7>(steps, king);
+  BatchPopCount(count, steps & ~me[6] & ~attacked);
+
+  // A pinned piece keeps the moves along its pin and never reaches past the pinner
+  V push, capture, promotions = {};
+  const V one = BatchShift<up>(push, me[0] & (free | pin[0])) & empty;
+  const V pawns = (one | (BatchShift<up>(push, one & rank3) & empty) | (BatchShift<left>(capture, me[0] & (free | pin[wtm ? 3 : 2])) & you[6])) & good;
+  const V pawns_right = BatchShift<right>(capture, me[0] & (free | pin[wtm ? 2 : 3])) & you[6] & good;
+  BatchPopCount(count, pawns);
+  BatchPopCount(count, pawns_right);
+  BatchPopCount(promotions, pawns & rank8);
+  BatchPopCount(promotions, pawns_right & rank8);
+  count += 3 * promotions;
+  BatchCountShifts<17, 15, 10, 6, -6, -10, -15, -17>(count, me[1] & free, good);
+  BatchCountRays<8, -8>(count, (me[3] | me[4]) & (free | pin[0]), good, empty);
+  BatchCountRays<1, -1>(count, (me[3] | me[4]) & (free | pin[1]), good, empty);
+  BatchCountRays<9, -9>(count, (me[2] | me[4]) & (free | pin[2]), good, empty);
+  BatchCountRays<7, -7>(count, (me[2] | me[4]) & (free | pin[3]), good, empty);
+
+  for (int i = 0; i < 2; i++) { // Chess960: with the rook gone a slider may see the king's square
+    const V legal = (V) ((castle & (wtm ? 1 << i : 4 << i)) != 0) & (V) (checkers == 0) & (V) ((~empty & (wtm ? g_castle_empty_w[i] : g_castle_empty_b[i])) == 0)
+                  & (V) ((attacked & (wtm ? g_castle_w[i] : g_castle_b[i])) == 0);
+    bool any = false;
+    for (int j = 0; j < lanes; j++) any |= legal[j] != 0;
+    if (!any) continue;
+    const int kto = (wtm ? 0 : 56) + (i ? 2 : 6), rto = (wtm ? 0 : 56) + (i ? 3 : 5);
+    const V target = V{} | Bit(kto), seen = (empty | king | Bit(wtm ? g_rook_w[i] : g_rook_b[i])) & ~(Bit(kto) | Bit(rto));
+    V bishop = {}, rook = {};
+    BatchRays<9, 7, -7, -9>(bishop, target, seen);
+    BatchRays<8, 1, -1, -8>(rook, target, seen);
+    count -= legal & (V) (((bishop & diag) | (rook & orth)) == 0); // legal lanes are -1
+  }
+
+  for (int i = 0; i < lanes; i++) counts[i] = (int) count[i];
+}
+
+template <bool wtm> int BatchEp(const Board *board) { // E.p. stays scalar: EpLegal() replays the capture on the real position
+  if (!EpCapturable(board, wtm)) 
+    return 0;
+  Board *const saved = g_board;
+  int count = 0;
+  g_board = const_cast<Board*>(board);
+  g_both  = board->white[6] | board->black[6];
+  for (std::uint64_t pieces = EpPawns(wtm); pieces; pieces = ClearBit(pieces)) 
+    count += EpLegal(wtm, Ctz(pieces));
+  g_board = saved;
+  return count;
+}
+
+#if defined __x86_64__
+template <bool wtm> __attribute__((target("avx2,popcnt"))) void BatchAvx2(const Board *const *boards, int *counts) {
+  BatchKernel<wtm, BatchLanes4>(boards, counts);
+}
+
+template <bool wtm> __attribute__((target("avx512f,avx512vpopcntdq,popcnt"))) void BatchAvx512(const Board *const *boards, int *counts) {
+  BatchKernel<wtm, BatchLanes8>(boards, counts);
+}
+#endif
+
+template <bool wtm> std::uint64_t BatchCount(const Board *boards, const int len) { // Sum of Count<wtm>() over boards[0 .. len), g_batch lanes at a time
+  const Board *lane[8];
+  int counts[8];
+  std::uint64_t nodes = 0;
+  for (int i = 0; i < len; i += g_batch) {
+    for (int j = 0; j < g_batch; j++) lane[j] = boards + std::min(i + j, len - 1); // Short tail: repeat the last board
+#if defined __x86_64__
+    if (g_batch == 8) BatchAvx512<wtm>(lane, counts);
+    else BatchAvx2<wtm>(lane, counts);
+#endif
+    for (int j = 0; j < g_batch && i + j < len; j++) nodes += counts[j] + BatchEp<wtm>(lane[j]);
+  }
+  return nodes;
+}
+
+int CpuBatchLanes() { // Widest leaf counter the CPU runs
+#if defined __x86_64__
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) return 8;
+  if (__builtin_cpu_supports("avx2")) return 4;
+#endif
+  return 0;
 }
 
 // Perft
 
-std::uint64_t PerftW(const int depth) {
-  Board moves[kMaxMoves];
-  const std::uint64_t hash = Hash(1);
-  std::uint64_t nodes = GetPerft(hash, depth);
+template <bool wtm, int depth> std::uint64_t PerftNear() { // The last plies: depth known at compile time
+  if constexpr (depth == 0) {
+    return (std::uint64_t) Count<wtm>();
+  } else {
+    Board moves[kMaxMoves];
+    const std::uint64_t hash = Hash(wtm);
+    std::uint64_t nodes = 0;
+
+    if (GetPerft(hash, depth, nodes)) 
+      return nodes;
+
+    const int len = Mgen<wtm>(moves);
+    g_copied += len * sizeof(Board);
+
+    if (depth == 1 && g_batch) {
+      nodes = BatchCount<!wtm>(moves, len);
+    } else {
+      for (int i = 0; i < len; i++) {
+        g_board = moves + i; 
+        nodes += PerftNear<!wtm, depth - 1>();
+      }
+    }
+
+    AddPerft(hash, nodes, depth);
 
-  if (nodes) 
     return nodes;
+  }
+}
 
-  const int len = MgenW(moves);
+template <bool wtm> std::uint64_t PerftCopy(const int depth) { // Copy-make
+  if (depth <= 2) 
+    return depth == 2 ? PerftNear<wtm, 2>() : depth == 1 ? PerftNear<wtm, 1>() : PerftNear<wtm, 0>();
 
-  if (depth <= 0) 
-    return (std::uint64_t) len;
+  Board moves[kMaxMoves];
+  const std::uint64_t hash = Hash(wtm);
+  std::uint64_t nodes = 0;
+
+  if (GetPerft(hash, depth, nodes)) 
+    return nodes;
+
+  const int len = Mgen<wtm>(moves);
+  g_copied += len * sizeof(Board);
 
   for (int i = 0; i < len; i++) {
     g_board = moves + i; 
-    nodes += PerftB(depth - 1);
+    nodes += PerftCopy<!wtm>(depth - 1);
   }
 
   AddPerft(hash, nodes, depth);
+  if (depth >= 3) HashtableSignalCheck();
 
   return nodes;
 }
 
-std::uint64_t PerftB(const int depth) {
-  Board moves[kMaxMoves];
-  const std::uint64_t hash = Hash(0);
-  std::uint64_t nodes = GetPerft(hash, depth);
+template <bool wtm> std::uint64_t PerftMake(const int depth) { // One board per searcher, DoMove/UndoMove
+  if (depth <= 0) 
+    return (std::uint64_t) Count<wtm>();
+
+  Move moves[kMaxMoves];
+  Undo undo;
+  const std::uint64_t hash = Hash(wtm);
+  std::uint64_t nodes = 0;
 
-  if (nodes) 
+  if (GetPerft(hash, depth, nodes)) 
     return nodes;
 
-  const int len = MgenB(moves);
-  
-  if (depth <= 0) 
-    return (std::uint64_t) len;
-  
+  const int len = MgenMoves(wtm, moves);
+  g_copied += len * sizeof(Undo);
+
   for (int i = 0; i < len; i++) {
-    g_board = moves + i; 
-    nodes += PerftW(depth - 1);
+    DoMove(wtm, moves[i], undo);
+    nodes += PerftMake<!wtm>(depth - 1);
+    UndoMove(wtm, moves[i], undo);
   }
-  
+
   AddPerft(hash, nodes, depth);
-  
+  if (depth >= 3) HashtableSignalCheck();
+
   return nodes;
 }
 
-std::uint64_t Perft(const int depth) {
+std::uint64_t PerftSide(const bool wtm, const int depth) {
+  if (g_makeunmake) return wtm ? PerftMake<true>(depth) : PerftMake<false>(depth);
+  return wtm ? PerftCopy<true>(depth) : PerftCopy<false>(depth);
+}
+
+// Journal
+
+std::string
+  g_journal = "";
+
+std::map<std::string, std::uint64_t>
+  g_journal_done;
+
+std::mutex
+  g_journal_lock;
+
+const std::string JournalKey(const int depth, const std::string &move) { // depth = perft depth below the root move. g_fen ends in " moves ..." after a server position with moves
+  return g_fen + ";" + std::to_string(depth) + ";" + move;
+}
+
+void JournalLoad() { // Lines: fen;depth;move;nodes
+  std::ifstream file(g_journal);
+  std::string line;
+  while (std::getline(file, line)) {
+    const std::size_t last = line.rfind(';');
+    if (last == std::string::npos || last + 1 >= line.length()) continue; // Torn last line of a killed run
+    g_journal_done[line.substr(0, last)] = std::stoull(line.substr(last + 1));
+  }
+  std::cout << "Journal: " << g_journal << " (" << g_journal_done.size() << " entries)" << std::endl;
+}
+
+bool JournalGet(const int depth, const std::string &move, std::uint64_t &nodes) {
+  if (g_journal.empty()) return false;
+  const auto it = g_journal_done.find(JournalKey(depth, move));
+  if (it == g_journal_done.end()) return false;
+  nodes = it->second;
+  return true;
+}
+
+void JournalPut(const int depth, const std::string &move, const std::uint64_t nodes) { // Appended and synced as soon as a root move is done
+  if (g_journal.empty()) return;
+  std::lock_guard<std::mutex> guard(g_journal_lock);
+  const std::string key = JournalKey(depth, move);
+  g_journal_done[key] = nodes;
+  FILE *file = fopen(g_journal.c_str(), "a");
+  Assert(file, "Error #8: Can't write journal");
+  fprintf(file, "%s;%llu\n", key.c_str(), (unsigned long long) nodes);
+  fflush(file);
+  fsync(fileno(file));
+  fclose(file);
+}
+
+std::uint64_t JournalRootMove(const Board *orig, Board *move, const int depth) { // Perft(depth + 1) below one root move
+  const std::string name = MoveName(orig, move);
+  std::uint64_t nodes = 0;
+  if (JournalGet(depth + 1, name, nodes)) return nodes;
+  g_board = move;
+  nodes = PerftSide(!g_wtm, depth);
+  JournalPut(depth + 1, name, nodes);
+  return nodes;
+}
+
+// Threads
+
+struct Task {
+  Board board;
+  int depth, ply, root;
+  bool wtm;
+};
+
+struct Worker {
+  std::deque<Task> tasks;
+  std::mutex lock;
+};
+
+std::unique_ptr<Worker[]>
+  g_workers;
+
+std::unique_ptr<std::atomic<std::uint64_t>[]>
+  g_root_nodes;
+
+std::unique_ptr<std::atomic<int>[]>
+  g_root_tasks; // Unfinished tasks per root move. Hits 0 once its subtree is done
+
+std::vector<std::string>
+  g_root_names;
+
+int
+  g_root_depth = 0;
+
+std::atomic<std::uint64_t>
+  g_tasks_pending(0);
+
+std::atomic<int>
+  g_workers_idle(0);
+
+void PushTask(const int id, const Task &task) {
+  std::lock_guard<std::mutex> guard(g_workers[id].lock);
+  g_workers[id].tasks.push_back(task);
+}
+
+bool PopTask(const int id, Task &task) { // Own work: newest first (depth-first, small deques)
+  std::lock_guard<std::mutex> guard(g_workers[id].lock);
+  if (g_workers[id].tasks.empty()) return false;
+  task = g_workers[id].tasks.back();
+  g_workers[id].tasks.pop_back();
+  return true;
+}
+
+bool StealTask(const int id, Task &task) { // Others' work: oldest first (biggest subtrees)
+  for (int i = 1; i < g_threads; i++) {
+    Worker &victim = g_workers[(id + i) % g_threads];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (victim.tasks.empty()) continue;
+    task = victim.tasks.front();
+    victim.tasks.pop_front();
+    return true;
+  }
+  return false;
+}
+
+bool SplitTask(const Task &task) { // Always split the first plies, deeper only when someone starves
+  return task.depth >= 2 && (task.ply < 2 || (task.depth >= 3 && g_workers_idle.load(std::memory_order_relaxed)));
+}
+
+void RunTask(const int id, Task &task) {
+  g_board = &task.board;
+  if (!SplitTask(task)) {
+    g_root_nodes[task.root] += PerftSide(task.wtm, task.depth);
+    return;
+  }
+  Board moves[kMaxMoves];
+  const int len = MgenBoards(task.wtm, moves);
+  g_tasks_pending += len;
+  g_root_tasks[task.root] += len;
+  for (int i = 0; i < len; i++) PushTask(id, {moves[i], task.depth - 1, task.ply + 1, task.root, !task.wtm});
+}
+
+void WorkerLoop(const int id, const Setup setup) {
+  Task task;
+  bool idle = false;
+  LoadSetup(setup);
+  while (g_tasks_pending) {
+    if (PopTask(id, task) || StealTask(id, task)) {
+      if (idle) {idle = false; g_workers_idle--;}
+      RunTask(id, task);
+      if (!--g_root_tasks[task.root]) JournalPut(g_root_depth + 1, g_root_names[task.root], g_root_nodes[task.root]);
+      g_tasks_pending--;
+    } else {
+      if (!idle) {idle = true; g_workers_idle++;}
+      HashtableSignalCheck();
+      std::this_thread::yield();
+    }
+  }
+  if (idle) g_workers_idle--;
+  g_copied_workers += g_copied;
+  g_copied = 0;
+}
+
+int ParallelRoot(Board *moves, const int depth) { // Fills g_root_nodes with Perft(depth) of every root move
+  Board *orig = g_board;
+  const int len = MgenBoards(g_wtm, moves);
+  std::vector<std::thread> threads;
+  g_board = orig;
+  g_workers.reset(new Worker[g_threads]);
+  g_root_nodes.reset(new std::atomic<std::uint64_t>[kMaxMoves]);
+  g_root_tasks.reset(new std::atomic<int>[kMaxMoves]);
+  g_root_names.clear();
+  g_root_depth = depth;
+  g_tasks_pending = 0;
+  for (int i = 0, n = 0; i < len; i++) {
+    std::uint64_t nodes = 0;
+    g_root_names.push_back(MoveName(orig, moves + i));
+    g_root_nodes[i] = 0;
+    g_root_tasks[i] = 1;
+    if (JournalGet(depth + 1, g_root_names[i], nodes)) {g_root_nodes[i] = nodes; continue;}
+    g_tasks_pending++;
+    g_workers[n++ % g_threads].tasks.push_back({moves[i], depth, 1, i, !g_wtm});
+  }
+  for (int i = 1; i < g_threads; i++) threads.emplace_back(WorkerLoop, i, SaveSetup());
+  WorkerLoop(0, SaveSetup()); // The main thread searches too: it saves the hashtable on a signal
+  for (auto &thread : threads) thread.join();
+  g_board = orig;
+  g_workers.reset();
+  return len;
+}
+
+std::uint64_t PerftParallel(const int depth) {
+  Board moves[kMaxMoves];
+  std::uint64_t nodes = 0;
+  const int len = ParallelRoot(moves, depth - 2);
+  for (int i = 0; i < len; i++) nodes += g_root_nodes[i];
+  return nodes;
+}
+
+std::uint64_t PerftJournal(const int depth) {
+  Board moves[kMaxMoves];
+  Board *orig = g_board;
+  std::uint64_t nodes = 0;
+  const int len = MgenBoards(g_wtm, moves);
+  for (int i = 0; i < len; i++) nodes += JournalRootMove(orig, moves + i, depth - 2);
+  g_board = orig;
+  return nodes;
+}
+
+std::uint64_t PerftRoot(const int depth) { // Keeps the hashtable age. For many positions that belong to one run
   if (depth <= 0) return 1;
-  return g_wtm ? PerftW(depth - 1) : PerftB(depth - 1);
+  if (g_threads > 1 && depth >= 3) return PerftParallel(depth);
+  if (!g_journal.empty() && depth >= 2) return PerftJournal(depth);
+  return PerftSide(g_wtm, depth - 1);
+}
+
+std::uint64_t Perft(const int depth) {
+  g_hash_age++;
+  return PerftRoot(depth);
 }
 
 const std::string BigNumber(const std::uint64_t number) { // 561735852 -> 561,735,852
@@ -932,11 +1943,16 @@ const std::string MoveStr(const int from, const int to) {
   return std::string{(char) ('a' + Xcoord(from)), (char) ('1' + Ycoord(from)), (char) ('a' + Xcoord(to)), (char) ('1' + Ycoord(to))};
 }
 
-const std::string MoveName(const Board *orig, const Board *move) {
+inline bool IsCastle(const Board *orig, const Board *move) { // The king "takes" its own rook
+  const std::uint64_t mine = (orig->white[6] & Bit(move->from)) ? orig->white[6] : orig->black[6];
+  return mine & Bit(move->to);
+}
+
+const std::string MoveName(const Board *orig, const Board *move) { // Castling is king takes rook: "e1h1", "f1h1". Unique, so it keys the journal too
   auto from = move->from, to = move->to;
 
-  if (std::abs(orig->pieces[from]) !=  std::abs(move->pieces[to])) {
-    switch (std::abs(move->pieces[to])) {
+  if (!IsCastle(orig, move) && std::abs(PieceAt(from, orig)) != std::abs(PieceAt(to, move))) {
+    switch (std::abs(PieceAt(to, move))) {
     case 2: return MoveStr(from, to) + 'n';
     case 3: return MoveStr(from, to) + 'b';
     case 4: return MoveStr(from, to) + 'r';
@@ -946,15 +1962,39 @@ const std::string MoveName(const Board *orig, const Board *move) {
   return MoveStr(from, to);
 }
 
+void SplitParallel(const int depth) {
+  Board moves[kMaxMoves];
+  const int len = ParallelRoot(moves, depth - 1);
+
+  for (int i = 0; i < len; i++)
+    std::cout << (i + 1) << " : " << MoveName(g_board, moves + i) << " : " << BigNumber(g_root_nodes[i]) << std::endl;
+}
+
 void Split(const int depth) {
+  if (g_threads > 1) {
+    SplitParallel(depth);
+    return;
+  }
   Board moves[kMaxMoves];
   Board *orig = g_board;
-  const int len = g_wtm ? MgenW(moves) : MgenB(moves);
+  const int len = MgenBoards(g_wtm, moves);
   
-  for (int i = 0; i < len; i++) {
-    g_board = moves + i;
-    std::cout << (i + 1) << " : " << MoveName(orig, g_board) << " : " << BigNumber(g_wtm ? PerftB(depth - 1) : PerftW(depth - 1)) << std::endl;
-  }
+  for (int i = 0; i < len; i++) 
+    std::cout << (i + 1) << " : " << MoveName(orig, moves + i) << " : " << BigNumber(JournalRootMove(orig, moves + i, depth - 1)) << std::endl;
+  g_board = orig;
+}
+
+std::vector<std::pair<std::string, std::uint64_t>> Divide(const int depth) { // Perft(depth - 1) below every root move. Depth >= 1
+  Board moves[kMaxMoves];
+  Board *orig = g_board;
+  std::vector<std::pair<std::string, std::uint64_t>> ret = {};
+  const bool parallel = g_threads > 1 && depth >= 3;
+  g_hash_age++;
+  const int len = parallel ? ParallelRoot(moves, depth - 2) : MgenBoards(g_wtm, moves);
+  for (int i = 0; i < len; i++) 
+    ret.push_back({MoveName(orig, moves + i), parallel ? (std::uint64_t) g_root_nodes[i] : depth == 1 ? 1 : JournalRootMove(orig, moves + i, depth - 2)});
+  g_board = orig;
+  return ret;
 }
 
 double GetNps(const std::uint64_t nodes, const std::uint64_t ms) {
@@ -975,10 +2015,356 @@ void PerftPrintTotal(const std::uint64_t nodes, const std::uint64_t ms) {
   std::cout << std::setfill(' ') << std::setprecision(6) << "=" << std::setw(18) << BigNumber(nodes) << std::setw(14) << GetNps(nodes, ms) << std::setw(12) << GetTime(ms) << std::endl;
 }
 
+// Work units
+
+struct Unit {
+  std::string fen;
+  std::uint64_t count;
+  int depth;
+};
+
+const std::string BoardFen(const Board *board, const bool wtm) { // Castling as rook files (Shredder-FEN), so Chess960 survives the trip
+  std::string fen = "";
+  for (int y = 7; y >= 0; y--) {
+    int empty = 0;
+    for (int x = 0; x < 8; x++) {
+      const int piece = PieceAt(8 * y + x, board);
+      if (!piece) {empty++; continue;}
+      if (empty) fen += (char) ('0' + empty);
+      fen += piece > 0 ? "PNBRQK"[piece - 1] : "pnbrqk"[-piece - 1];
+      empty = 0;
+    }
+    if (empty) fen += (char) ('0' + empty);
+    if (y) fen += '/';
+  }
+  fen += wtm ? " w " : " b ";
+  if (board->castle & 1) fen += (char) ('A' + g_rook_w[0]);
+  if (board->castle & 2) fen += (char) ('A' + g_rook_w[1]);
+  if (board->castle & 4) fen += (char) ('a' + g_rook_b[0] - 56);
+  if (board->castle & 8) fen += (char) ('a' + g_rook_b[1] - 56);
+  if (!board->castle) fen += '-';
+  fen += EpCapturable(board, wtm) ? std::string{' ', (char) ('a' + Xcoord(board->epsq)), (char) ('1' + Ycoord(board->epsq))} : " -";
+  return fen + " 0 1";
+}
+
+template <class Visit> void FrontierWalk(const bool wtm, const int ply, Visit &visit) { // visit(board) once per path ply moves deep
+  if (ply <= 0) {
+    visit(g_board);
+    return;
+  }
+  Board moves[kMaxMoves];
+  Board *orig = g_board;
+  const int len = MgenBoards(wtm, moves);
+  for (int i = 0; i < len; i++) {
+    g_board = moves + i;
+    FrontierWalk(!wtm, ply - 1, visit);
+  }
+  g_board = orig;
+}
+
+std::vector<Unit> UnitsRead(const std::string &file_name, std::string &header) { // Lines: id;fen;count;depth
+  std::vector<Unit> units;
+  std::ifstream file(file_name);
+  std::string line;
+  Assert(file.good() && std::getline(file, header), "Error #9: Can't read units");
+  while (std::getline(file, line)) {
+    std::vector<std::string> tokens = {};
+    Splitter<std::vector<std::string>>(line, tokens, ";");
+    Assert(tokens.size() == 4 && std::stoull(tokens[0]) == units.size(), "Error #10: Bad unit");
+    units.push_back({tokens[1], std::stoull(tokens[2]), std::stoi(tokens[3])});
+  }
+  return units;
+}
+
+void UnitsExport(const int depth, const int ply, const std::string &file_name) { // Perft(depth) = sum of count * Perft(depth - ply) over the units
+  Assert(ply >= 0 && ply <= depth, "Error #10: Bad unit");
+  std::map<std::string, std::uint64_t> frontier; // Same position by many move orders -> one unit
+  std::uint64_t paths = 0, id = 0;
+  const bool wtm = g_wtm ^ (ply & 1);
+  auto visit = [&](const Board *board) {frontier[BoardFen(board, wtm)]++;};
+  FrontierWalk(g_wtm, ply, visit);
+  std::ofstream file(file_name);
+  file << "# " << g_fen << ";" << depth << ";" << ply << "\n";
+  for (const auto &unit : frontier) {
+    file << id++ << ";" << unit.first << ";" << unit.second << ";" << (depth - ply) << "\n";
+    paths += unit.second;
+  }
+  file.close();
+  Assert(file.good(), "Error #9: Can't write units");
+  std::cout << "Units: " << BigNumber(frontier.size()) << " positions from " << BigNumber(paths) << " paths -> " << file_name << std::endl;
+}
+
+void UnitsWork(const std::string &units_name, const std::string &results_name, const std::uint64_t first, const std::uint64_t count) { // Results: id;fen;nodes
+  std::string header;
+  const std::vector<Unit> units = UnitsRead(units_name, header);
+  std::vector<bool> done(units.size(), false);
+  std::ifstream old(results_name);
+  for (std::string line; std::getline(old, line); ) { // A restarted worker continues where it stopped
+    std::vector<std::string> tokens = {};
+    Splitter<std::vector<std::string>>(line, tokens, ";");
+    if (tokens.size() == 3 && std::stoull(tokens[0]) < units.size()) done[std::stoull(tokens[0])] = true;
+  }
+  FILE *file = fopen(results_name.c_str(), "a");
+  Assert(file, "Error #9: Can't write results");
+  g_hash_age++;
+  const std::uint64_t start = Now();
+  std::uint64_t nodes = 0, n = 0;
+  for (std::uint64_t i = first; i < units.size() && i - first < count; i++) {
+    if (done[i]) continue;
+    Fen(units[i].fen);
+    const std::uint64_t result = PerftRoot(units[i].depth);
+    fprintf(file, "%llu;%s;%llu\n", (unsigned long long) i, units[i].fen.c_str(), (unsigned long long) result);
+    fflush(file);
+    nodes += result;
+    n++;
+  }
+  fclose(file);
+  const std::uint64_t ms = Now() - start;
+  std::cout << "Worked: " << BigNumber(n) << " units / " << BigNumber(nodes) << " nodes / " << GetNps(nodes, ms) << " Mnps -> " << results_name << std::endl;
+}
+
+bool UnitsMerge(const std::string &units_name, const std::vector<std::string> &results_names) {
+  std::string header;
+  const std::vector<Unit> units = UnitsRead(units_name, header);
+  std::vector<std::uint64_t> nodes(units.size(), 0);
+  std::vector<bool> done(units.size(), false);
+  for (const auto &name : results_names) {
+    std::ifstream file(name);
+    Assert(file.good(), "Error #9: Can't read results");
+    for (std::string line; std::getline(file, line); ) {
+      std::vector<std::string> tokens = {};
+      Splitter<std::vector<std::string>>(line, tokens, ";");
+      if (tokens.size() != 3) continue; // Torn last line of a killed worker
+      const std::uint64_t id = std::stoull(tokens[0]), result = std::stoull(tokens[2]);
+      Assert(id < units.size() && tokens[1] == units[id].fen, "Error #10: Result for another unit file");
+      Assert(!done[id] || nodes[id] == result, "Error #10: Workers disagree");
+      nodes[id] = result;
+      done[id] = true;
+    }
+  }
+  std::uint64_t total = 0, missing = 0;
+  for (std::size_t i = 0; i < units.size(); i++) {
+    if (!done[i]) {
+      if (missing++ < 10) std::cout << "Missing: " << i << ";" << units[i].fen << std::endl;
+      continue;
+    }
+    total += units[i].count * nodes[i];
+  }
+  std::cout << "[ " << header.substr(2) << " ]" << std::endl;
+  std::cout << "Units: " << BigNumber(units.size() - missing) << " / " << BigNumber(units.size()) << std::endl;
+  if (missing) {
+    std::cout << "Incomplete: " << BigNumber(missing) << " units missing" << std::endl;
+    return false;
+  }
+  std::cout << "Nodes: " << BigNumber(total) << std::endl;
+  return true;
+}
+
+// Frontier dedup
+
+struct PackedBoard { // 32 bytes instead of the 128 of a Board
+  std::uint64_t both;
+  std::uint8_t pieces[16]; // piece + 6 per nibble, in square order
+  std::uint32_t count;     // Move orders reaching the position. 0 = empty slot
+  std::uint8_t castle;
+  std::int8_t epsq;
+  std::uint16_t unused;
+};
+
+std::vector<PackedBoard>
+  g_frontier;
+
+std::size_t
+  g_frontier_n = 0;
+
+PackedBoard PackBoard(const Board *board, const bool wtm) {
+  PackedBoard packed = {};
+  packed.both = board->white[6] | board->black[6];
+  for (int i = 0; i < 6; i++) {
+    for (std::uint64_t pieces = board->white[i]; pieces; pieces = ClearBit(pieces)) {
+      const int n = PopCount(packed.both & (Bit(Ctz(pieces)) - 1)); // Rank among the occupied squares
+      packed.pieces[n / 2] |= (i + 7) << (4 * (n & 1));
+    }
+    for (std::uint64_t pieces = board->black[i]; pieces; pieces = ClearBit(pieces)) {
+      const int n = PopCount(packed.both & (Bit(Ctz(pieces)) - 1));
+      packed.pieces[n / 2] |= (5 - i) << (4 * (n & 1));
+    }
+  }
+  packed.count  = 1;
+  packed.castle = board->castle;
+  packed.epsq   = EpCapturable(board, wtm) ? board->epsq : -1;
+  return packed;
+}
+
+void UnpackBoard(const PackedBoard &packed, Board *board) {
+  int n = 0;
+  board->reset();
+  g_board = board;
+  for (std::uint64_t both = packed.both; both; both = ClearBit(both), n++) 
+    PutPiece(((packed.pieces[n / 2] >> (4 * (n & 1))) & 0xF) - 6, Ctz(both));
+  board->castle = packed.castle;
+  board->epsq   = packed.epsq;
+  board->hash   = HashBoard();
+}
+
+std::uint64_t PackedKey(const PackedBoard &packed) {
+  std::uint64_t lo, hi;
+  std::memcpy(&lo, packed.pieces,     8);
+  std::memcpy(&hi, packed.pieces + 8, 8);
+  const std::uint64_t key = (packed.both ^ (lo * 0x9E3779B97F4A7C15ULL) ^ (hi * 0xC2B2AE3D27D4EB4FULL) ^ (packed.castle << 8) ^ (std::uint8_t) packed.epsq) * 0xFF51AFD7ED558CCDULL;
+  return key ^ (key >> 32);
+}
+
+bool PackedSame(const PackedBoard &a, const PackedBoard &b) {
+  return a.both == b.both && !std::memcmp(a.pieces, b.pieces, sizeof(a.pieces)) && a.castle == b.castle && a.epsq == b.epsq;
+}
+
+void FrontierAdd(const PackedBoard &packed) { // Open addressing, linear probing, at most half full
+  if (2 * (g_frontier_n + 1) > g_frontier.size()) {
+    std::vector<PackedBoard> old(2 * g_frontier.size());
+    old.swap(g_frontier);
+    g_frontier_n = 0;
+    for (const auto &entry : old) if (entry.count) FrontierAdd(entry);
+  }
+  const std::size_t mask = g_frontier.size() - 1;
+  for (std::size_t i = PackedKey(packed) & mask; ; i = (i + 1) & mask) {
+    if (!g_frontier[i].count) {
+      g_frontier[i] = packed;
+      g_frontier_n++;
+      return;
+    }
+    if (PackedSame(g_frontier[i], packed)) {
+      Assert(g_frontier[i].count + packed.count > g_frontier[i].count, "Error #11: Frontier count overflow");
+      g_frontier[i].count += packed.count;
+      return;
+    }
+  }
+}
+
+void FrontierCount(const Setup setup, const bool wtm, const int depth, std::atomic<std::size_t> *next, std::atomic<std::uint64_t> *nodes) { // Perft(depth) of every unique position times its count
+  Board board, *orig = g_board;
+  std::uint64_t sum = 0;
+  LoadSetup(setup);
+  for (std::size_t i; (i = (*next)++) < g_frontier.size(); ) {
+    if (!g_frontier[i].count) continue;
+    UnpackBoard(g_frontier[i], &board);
+    sum += g_frontier[i].count * (depth > 0 ? PerftSide(wtm, depth - 1) : 1);
+  }
+  g_board = orig; // Not our local board once we return
+  *nodes += sum;
+  g_copied_workers += g_copied;
+  g_copied = 0;
+}
+
+void PerftDedup(const int depth, const int ply) { // Perft(depth) = sum of count * Perft(depth - ply) over unique positions ply moves deep
+  Assert(ply >= 0 && ply <= depth, "Error #11: Bad frontier ply");
+  std::uint64_t paths = 0, start = Now();
+  std::atomic<std::size_t> next(0);
+  std::atomic<std::uint64_t> nodes(0);
+  const bool wtm = g_wtm ^ (ply & 1);
+  g_frontier.assign(1024, {});
+  g_frontier_n = 0;
+  g_hash_age++;
+  auto visit = [&](const Board *board) {FrontierAdd(PackBoard(board, wtm)); paths++;};
+  FrontierWalk(g_wtm, ply, visit);
+  const std::uint64_t walk_ms = Now() - start;
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < g_threads; i++) threads.emplace_back(FrontierCount, SaveSetup(), wtm, depth - ply, &next, &nodes);
+  FrontierCount(SaveSetup(), wtm, depth - ply, &next, &nodes);
+  for (auto &thread : threads) thread.join();
+  const std::uint64_t ms = Now() - start;
+
+  std::cout << "[ " << g_fen << " ]" << std::endl;
+  std::cout << "Frontier: ply " << ply << " / " << BigNumber(paths) << " paths / " << BigNumber(g_frontier_n) << " unique / " 
+            << std::setprecision(4) << (g_frontier_n ? (double) paths / g_frontier_n : 0.0) << "x dedup / " << BigNumber(g_frontier.size() * sizeof(PackedBoard) / 1024) << " KB / " << GetTime(walk_ms) << " s" << std::endl;
+  std::cout << "Nodes: " << BigNumber(nodes) << " / " << GetNps(nodes, ms) << " Mnps / " << GetTime(ms) << " s" << std::endl;
+  std::vector<PackedBoard>().swap(g_frontier);
+}
+
+// Stats
+
+struct Stats { // Breakdown of the moves at the last ply
+  std::uint64_t nodes, captures, ep, castles, promotions, checks, discovered, doubles, mates;
+  void add(const Stats &other);
+};
+
+void Stats::add(const Stats &other) {
+  nodes += other.nodes; captures += other.captures; ep += other.ep; castles += other.castles; promotions += other.promotions; 
+  checks += other.checks; discovered += other.discovered; doubles += other.doubles; mates += other.mates;
+}
+
+struct StatsEntry {
+  std::uint64_t hash;
+  int depth;
+  Stats stats;
+};
+
+std::vector<StatsEntry>
+  g_stats_hash; // Own table: a whole Stats doesn't fit a MyHash entry
+
+void StatsLeaf(const Board *orig, const Board *child, const bool wtm, Stats &stats) { // wtm moved orig -> child
+  const std::uint64_t *me = wtm ? child->white : child->black, *me_before = wtm ? orig->white : orig->black;
+  const std::uint64_t *you = wtm ? child->black : child->white, *you_before = wtm ? orig->black : orig->white;
+  const std::uint64_t moved = me[6] & ~me_before[6], taken = you_before[6] & ~you[6]; // Squares the mover arrived at / the victim left
+  const std::uint64_t checkers = Attackers(me, wtm, Ctz(you[5]), me[6] | you[6]);
+  stats.nodes++;
+  stats.captures   += taken != 0;
+  stats.ep         += (taken & ~moved) != 0; // The only capture not on the destination
+  stats.castles    += IsCastle(orig, child); // The generator's king-takes-rook move: in Chess960 king or rook may stay put
+  stats.promotions += PopCount(me[0]) < PopCount(me_before[0]);
+  if (!checkers) return;
+  stats.checks++;
+  stats.discovered += (checkers & ~moved) && PopCount(checkers) == 1; // Tables count double checks on their own
+  stats.doubles    += PopCount(checkers) >= 2;
+  g_board = (Board*) child;
+  stats.mates      += !(wtm ? Count<false>() : Count<true>());
+}
+
+Stats PerftStats(const bool wtm, const int depth) { // depth >= 1 plies below g_board
+  Board moves[kMaxMoves];
+  Board *orig = g_board;
+  const std::uint64_t hash = Hash(wtm);
+  StatsEntry &entry = g_stats_hash[hash & (g_stats_hash.size() - 1)];
+  if (entry.hash == hash && entry.depth == depth) return entry.stats;
+
+  Stats stats = {};
+  const int len = MgenBoards(wtm, moves);
+  for (int i = 0; i < len; i++) {
+    if (depth == 1) {
+      StatsLeaf(orig, moves + i, wtm, stats);
+    } else {
+      g_board = moves + i;
+      stats.add(PerftStats(!wtm, depth - 1));
+    }
+  }
+  g_board = orig;
+  entry = {hash, depth, stats};
+  return stats;
+}
+
+void StatsRun(const int depth, const int hash_mb) { // Single thread
+  std::size_t entries = 1;
+  while (2 * entries * sizeof(StatsEntry) <= (std::size_t) (hash_mb > 0 ? hash_mb : kHashMb) << 20) entries *= 2;
+  g_stats_hash.assign(entries, {});
+  std::cout << "[ " << g_fen << " ]" << std::endl;
+  std::cout << "Depth         Nodes      Captures          E.p.       Castles    Promotions        Checks  Disc. checks Double checks    Checkmates        Time" << std::endl;
+  for (int i = 1; i <= depth; i++) {
+    Fen(g_fen);
+    const std::uint64_t start = Now();
+    const Stats stats = PerftStats(g_wtm, i);
+    std::cout << std::setfill(' ') << std::setprecision(6) << i << std::setw(18 - (i > 9 ? 1 : 0)) << BigNumber(stats.nodes);
+    for (const auto n : {stats.captures, stats.ep, stats.castles, stats.promotions, stats.checks, stats.discovered, stats.doubles, stats.mates}) std::cout << std::setw(14) << BigNumber(n);
+    std::cout << std::setw(12) << GetTime(Now() - start) << std::endl;
+  }
+  std::vector<StatsEntry>().swap(g_stats_hash);
+}
+
 void PerftRun(const int depth) {
   std::uint64_t nodes, start_time, diff_time, totaltime = 0, allnodes = 0;
   std::cout << "[ " << g_fen << " ]" << std::endl;
   std::cout << "Depth         Nodes          Mnps        Time" << std::endl;
+  HashStatsReset();
 
   for (int i = 0; i < depth + 1; i++) {
     Fen(g_fen);
@@ -988,10 +2374,12 @@ void PerftRun(const int depth) {
     totaltime  += diff_time;
     allnodes   += nodes;
     PerftPrint(i, nodes, diff_time);
+    if (diff_time >= 60000) HashtableSave(); // Long depths are checkpointed
   }
 
   std::cout << std::setfill('=') << std::setw(46) << ' ' << std::endl;
   PerftPrintTotal(allnodes, totaltime);
+  HashStatsPrint();
 }
 
 std::uint64_t SuiteRun(const int depth) {
@@ -1009,27 +2397,86 @@ std::uint64_t SuiteRun(const int depth) {
   return allnodes;
 }
 
+// EPD suite
+
+struct Epd {
+  std::string fen;
+  std::vector<std::pair<int, std::uint64_t>> perfts; // ;D1 20 ;D2 400 ...
+  std::string error; // A bad line is a FAIL, not a crash of the whole suite
+};
+
+std::vector<Epd> EpdRead(const std::string &file_name) {
+  std::vector<Epd> suite;
+  std::ifstream file(file_name);
+  std::string line;
+  Assert(file.good(), "Error #12: Can't read suite");
+  while (std::getline(file, line)) {
+    std::vector<std::string> tokens = {};
+    Splitter<std::vector<std::string>>(line, tokens, ";");
+    if (tokens.size() < 2 || tokens[0][0] == '#') continue;
+    Epd epd = {tokens[0].substr(0, tokens[0].find_last_not_of(' ') + 1), {}, ""};
+    if (!FenOk(epd.fen)) epd.error = " bad fen";
+    for (std::size_t i = 1; i < tokens.size() && epd.error.empty(); i++) {
+      std::istringstream perft(tokens[i]);
+      std::string depth;
+      std::uint64_t nodes = 0;
+      if (!(perft >> depth)) continue;
+      if (depth.length() < 2 || depth[0] != 'D' || !isdigit(depth[1]) || !(perft >> nodes)) epd.error = " bad perft " + tokens[i];
+      else epd.perfts.push_back({std::stoi(depth.substr(1)), nodes});
+    }
+    suite.push_back(epd);
+  }
+  return suite;
+}
+
+void EpdWorker(const Setup setup, const std::vector<Epd> *suite, const int max_depth, std::atomic<std::size_t> *next, std::atomic<std::uint64_t> *nodes, std::atomic<int> *failed, std::mutex *print) { // One whole position per thread
+  LoadSetup(setup); // The hashtable
+  for (std::size_t i; (i = (*next)++) < suite->size(); ) {
+    const Epd &epd = (*suite)[i];
+    std::uint64_t my_nodes = 0, start = Now();
+    std::string report = epd.error;
+    for (const auto &perft : epd.perfts) {
+      if (perft.first > max_depth) continue;
+      Fen(epd.fen);
+      const std::uint64_t result = perft.first <= 0 ? 1 : PerftSide(g_wtm, perft.first - 1);
+      my_nodes += result;
+      if (result != perft.second) report += " D" + std::to_string(perft.first) + " " + BigNumber(result) + " != " + BigNumber(perft.second);
+    }
+    const std::uint64_t ms = Now() - start;
+    *nodes += my_nodes;
+    if (!report.empty()) (*failed)++;
+    std::lock_guard<std::mutex> guard(*print);
+    std::cout << "#" << (i + 1) << (report.empty() ? " ok " : " FAIL ") << std::setprecision(4) << GetNps(my_nodes, ms) << " Mnps [ " << epd.fen << " ]" << report << std::endl;
+  }
+  g_copied_workers += g_copied;
+  g_copied = 0;
+}
+
+bool EpdRun(const std::string &file_name, const int max_depth) { // -threads N runs N positions at once
+  const std::vector<Epd> suite = EpdRead(file_name);
+  std::atomic<std::size_t> next(0);
+  std::atomic<std::uint64_t> nodes(0);
+  std::atomic<int> failed(0);
+  std::mutex print;
+  std::vector<std::thread> threads;
+  const std::uint64_t start = Now();
+  g_hash_age++;
+  for (int i = 1; i < g_threads; i++) threads.emplace_back(EpdWorker, SaveSetup(), &suite, max_depth, &next, &nodes, &failed, &print);
+  EpdWorker(SaveSetup(), &suite, max_depth, &next, &nodes, &failed, &print);
+  for (auto &thread : threads) thread.join();
+  std::cout << std::setfill('=') << std::setw(46) << ' ' << std::endl;
+  std::cout << "Suite: " << suite.size() << " positions, " << (suite.size() - failed) << " ok, " << failed << " failed" << std::endl;
+  PerftPrintTotal(nodes, Now() - start);
+  return !failed;
+}
+
 void Bench() {
-  std::uint64_t nodes = 0, start = Now();
+  g_copied = g_copied_workers = 0;
+  HashStatsReset();
+  std::uint64_t nodes = 0, start = Now(), ms;
   int nth = 0;
-  const std::vector<std::string> suite = {
-    // Normal : https://www.chessprogramming.org/Perft_Results
-    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0",
-    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0",
-    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0",
-    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0",
-    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 0",
-    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0",
-    // Chess960 : https://www.chessprogramming.org/Chess960_Perft_Results
-    "bqnb1rkr/pp3ppp/3ppn2/2p5/5P2/P2P4/NPP1P1PP/BQ1BNRKR w HFhf - 0",
-    "bnqbnr1r/p1p1ppkp/3p4/1p4p1/P7/3NP2P/1PPP1PP1/BNQB1RKR w HF - 0",
-    "nrbq2kr/ppppppb1/5n1p/5Pp1/8/P5P1/1PPPP2P/NRBQNBKR w HBhb - 0",
-    "1r1bkqbr/pppp1ppp/2nnp3/8/2P5/N4P2/PP1PP1PP/1RNBKQBR w Hh - 0",
-    "rkqnbbnr/ppppppp1/8/7p/3N4/6PP/PPPPPP2/RKQNBB1R w HAa - 0",
-    "rbqkr1bn/pp1ppp2/2p1n2p/6p1/8/4BPNP/PPPPP1P1/RBQKRN2 w EAea - 0"
-  };
 
-  for (auto fen : suite) {
+  for (auto fen : kBenchSuite) {
     if (nth++) std::cout << std::endl;
     g_fen = fen;
     std::cout << "[ #" << nth << ": " << fen << " ]" << std::endl;
@@ -1037,130 +2484,413 @@ void Bench() {
   }
 
   std::cout << '\n' << std::setfill('=') << std::setw(46) << '\n' << std::endl;
-  PerftPrintTotal(nodes, Now() - start);
+  ms = Now() - start;
+  std::cout << (g_pext ? "PEXT" : "Magic") << " sliders, " << (g_batch ? std::to_string(g_batch) + "-lane" : std::string("scalar")) << " leaves, " << (g_makeunmake ? "make/unmake" : "copy-make") << ": Board " << sizeof(Board) << " bytes, " << std::setprecision(3) 
+            << ((double) (g_copied + g_copied_workers) / (double) nodes) << " bytes/node copied, " << (1000000.0 * (double) ms / (double) nodes) << " ns/node" << std::endl;
+  PerftPrintTotal(nodes, ms);
+  HashStatsPrint();
   Assert(nodes == 21799671196, "Error #3: Broken move generator");
   // d6 = 21799671196 d5 = 561735852
 }
 
-// Init
+std::uint64_t StressNodes(const std::uint64_t hash) { // Payload derived from the key: any other count is a torn read
+  return ((hash * 0x9E3779B97F4A7C15ULL) >> 16) | 1; // Fits kHashNodeBits
+}
 
-std::uint64_t PermutateBb(const std::uint64_t moves, const int index) {
-  int total = 0, good[64] = {0};
-  std::uint64_t permutations = 0;
+void StressWorker(const Setup setup, const int id, std::atomic<std::uint64_t> *hits, std::atomic<std::uint64_t> *bad) {
+  LoadSetup(setup); // The hashtable
+  std::uint64_t x = 0x9E3779B97F4A7C15ULL * (id + 1), my_hits = 0, my_bad = 0;
+  for (int i = 0; i < (1 << 23); i++) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    const std::uint64_t key = StressNodes((x >> 32) & 255), hash = (key & ~g_hash_key) | (key & 15); // 256 keys fight over 16 slots
+    const std::uint8_t depth = (std::uint8_t) (hash >> 60);
+    if (x & 0x100) {
+      AddPerft(hash, StressNodes(hash), depth);
+    } else if (std::uint64_t nodes = 0; GetPerft(hash, depth, nodes)) {
+      my_hits++;
+      if (nodes != StressNodes(hash)) my_bad++;
+    }
+  }
+  *hits += my_hits;
+  *bad  += my_bad;
+}
+
+void Stress() {
+  const int threads = std::max(g_threads, 8);
+  const std::string kiwipete = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0";
+  std::atomic<std::uint64_t> hits(0), bad(0);
+  std::vector<std::thread> workers;
+  std::uint64_t start = Now();
+
+  HashtableSetSize(1);
+  for (int i = 0; i < threads; i++) workers.emplace_back(StressWorker, SaveSetup(), i, &hits, &bad);
+  for (auto &worker : workers) worker.join();
+  std::cout << "Hashtable: " << threads << " threads, " << BigNumber(hits) << " hits, " << BigNumber(bad) << " bad, " << GetTime(Now() - start) << " s" << std::endl;
+  Assert(!bad, "Error #4: Torn hashtable entry");
+
+  HashtableSetSize(1); // Tiny table: constant overwrites by every worker
+  g_threads = threads;
+  for (int i = 0; i < 3; i++) {
+    HashtableClear(); // Else runs 2 and 3 are a single root hit
+    Fen(kiwipete);
+    start = Now();
+    const std::uint64_t nodes = Perft(5);
+    std::cout << "Perft 5: " << threads << " threads, " << BigNumber(nodes) << " nodes, " << GetTime(Now() - start) << " s" << std::endl;
+    Assert(nodes == 193690690, "Error #4: Torn hashtable entry");
+  }
+}
 
-  for (int i = 0; i < 64; i++) if (moves & Bit(i)) good[total++] = i;
-  const int popn = PopCount(moves);
-  for (int i = 0; i < popn; i++) if ((1 << i) & index) permutations |= Bit(good[i]);
+std::uint64_t SimdCheckBoards(const bool wtm, std::vector<Board> &boards, const int lanes) { // Groups of lanes boards where the sums differ
+  std::uint64_t bad = 0;
+  g_batch = lanes;
+  for (std::size_t i = 0; i < boards.size(); i += lanes) {
+    const int len = std::min<int>(lanes, boards.size() - i);
+    std::uint64_t nodes = 0;
+    for (int j = 0; j < len; j++) {
+      g_board = &boards[i + j];
+      nodes  += wtm ? Count<true>() : Count<false>();
+    }
+    bad += nodes != (wtm ? BatchCount<true>(&boards[i], len) : BatchCount<false>(&boards[i], len));
+  }
+  return bad;
+}
+
+void SimdCheck() { // Every SIMD width the CPU has vs the scalar counter on all boards 0 .. 4 plies from the bench positions
+  const int batch = g_batch, widest = CpuBatchLanes();
+  const std::uint64_t start = Now();
+  std::uint64_t boards = 0, bad = 0;
+  std::vector<Board> list;
+  Assert(widest, "Error #14: No AVX2 on this CPU");
+  for (const auto &fen : kBenchSuite) {
+    Fen(fen);
+    for (int ply = 0; ply <= 4; ply++) {
+      const bool wtm = (ply & 1) ? !g_wtm : g_wtm;
+      auto flush = [&]() {
+        Board *const saved = g_board;
+        for (int lanes = 4; lanes <= widest; lanes *= 2) bad += SimdCheckBoards(wtm, list, lanes);
+        g_board = saved;
+        boards += list.size();
+        list.clear();
+      };
+      auto visit = [&](const Board *board) {list.push_back(*board); if (list.size() >= 4096) flush();};
+      FrontierWalk(g_wtm, ply, visit);
+      flush();
+    }
+  }
+  g_batch = batch;
+  std::cout << "Simd: 4 .. " << widest << " lanes, " << BigNumber(boards) << " boards, " << BigNumber(bad) << " bad, " << GetTime(Now() - start) << " s" << std::endl;
+  Assert(!bad, "Error #14: Batch counts differ from Count()");
+}
 
-  return permutations & moves;
+// Server
+
+struct Server { // Perft() leaves g_board on its last leaf: the position lives here between commands
+  Board board;
+  bool wtm = true, quit = false;
+};
+
+bool ServerNumber(const std::string &str, int &number) { // 0 .. 10^6, no exceptions
+  if (str.empty() || str.length() > 6 || str.find_first_not_of("0123456789") != std::string::npos) return false;
+  number = std::stoi(str);
+  return true;
 }
 
-std::uint64_t MakeSliderMagicMoves(const int *slider_vectors, const int square, const std::uint64_t moves) {
-  std::uint64_t possible_moves = 0;
-  const int x_square = Xcoord(square), y_square = Ycoord(square);
+void ServerLoad(const Server &server) {
+  g_board_tmp = server.board;
+  g_board     = &g_board_tmp;
+  g_wtm       = server.wtm;
+}
 
-  for (int i = 0; i < 4; i++) {
-    for (int j = 1; j < 8; j++) {
-      const int x = x_square + j * slider_vectors[2 * i], y = y_square + j * slider_vectors[2 * i + 1];
-      if (!OnBoard(x, y)) break;
-      const std::uint64_t tmp = Bit(8 * y + x);
-      possible_moves    |= tmp;
-      if (tmp & moves) break;
-    }
+bool ServerMove(const std::string &name) { // Plays a move named like -split prints it. A castle may also name the king's destination ("e1g1") if no king step does
+  Board moves[kMaxMoves];
+  Board *orig = g_board;
+  const int len = MgenBoards(g_wtm, moves);
+  g_board = orig;
+  int found = -1;
+  for (int i = 0; i < len && found < 0; i++) {
+    if (MoveName(orig, moves + i) == name) found = i;
+  }
+  for (int i = 0; i < len && found < 0; i++) {
+    if (IsCastle(orig, moves + i) && MoveStr(moves[i].from, Ctz(g_wtm ? moves[i].white[5] : moves[i].black[5])) == name) found = i;
   }
+  if (found >= 0) {
+    g_board_tmp = moves[found];
+    g_board     = &g_board_tmp;
+    g_wtm       = !g_wtm;
+    return true;
+  }
+  return false;
+}
 
-  return possible_moves & (~Bit(square));
+std::string ServerPosition(Server &server, const std::vector<std::string> &tokens) { // position startpos|fen FEN [moves MOVE...]
+  const Setup setup = SaveSetup();
+  std::string fen = tokens.size() >= 2 && tokens[1] == "startpos" ? kStartpos : "";
+  std::size_t i = 2;
+  for (; tokens.size() >= 2 && tokens[1] == "fen" && i < tokens.size() && tokens[i] != "moves"; i++) fen += (fen.empty() ? "" : " ") + tokens[i];
+  if (!FenOk(fen)) return "error position: bad fen";
+  if (i < tokens.size() && tokens[i] != "moves") return "error position: expected moves, got " + tokens[i];
+  Fen(fen);
+  for (i++; i < tokens.size(); i++) { // Past "moves"
+    if (ServerMove(tokens[i])) {g_fen += (g_fen == fen ? " moves " : " ") + tokens[i]; continue;}
+    LoadSetup(setup); // Castling squares of the old position
+    return "error position: illegal move " + tokens[i];
+  }
+  server.board = *g_board;
+  server.wtm   = g_wtm;
+  return "ok position";
+}
+
+std::string ServerDivide(const Server &server, const int depth) { // "move NAME NODES" per root move, then the total
+  std::ostringstream out;
+  std::uint64_t nodes = 0;
+  const std::uint64_t start = Now();
+  ServerLoad(server);
+  for (const auto &move : Divide(depth)) {
+    out << "move " << move.first << ' ' << move.second << '\n';
+    nodes += move.second;
+  }
+  out << "ok divide " << depth << ' ' << nodes << ' ' << (Now() - start);
+  return out.str();
 }
 
-void InitBishopMagics() {
-  for (int i = 0; i < 64; i++) {
-    const std::uint64_t magics = kBishopMoveMagics[i] & (~Bit(i));
-    for (int j = 0; j < 512; j++) {
-      const std::uint64_t allmoves = PermutateBb(magics, j);
-#ifdef PEXT
-      g_bishop_magic_moves[i][Pext(allmoves, kBishopMask[i])] = MakeSliderMagicMoves(kBishopVectors, i, allmoves);
-#else
-      g_bishop_magic_moves[i][BishopMagicIndex(i, allmoves)] = MakeSliderMagicMoves(kBishopVectors, i, allmoves);
-#endif
-    }
+std::string ServerCommand(Server &server, const std::string &line) { // One line in, one answer (divide: one line per move first)
+  std::vector<std::string> tokens = {};
+  std::istringstream in(line);
+  int number = 0;
+  for (std::string token; in >> token;) tokens.push_back(token);
+  if (tokens.empty()) return "";
+  const std::string &cmd = tokens[0];
+  if (cmd == "position") return ServerPosition(server, tokens);
+  if (cmd == "perft" || cmd == "divide") {
+    if (tokens.size() != 2 || !ServerNumber(tokens[1], number) || number > 63 || (cmd == "divide" && !number)) return "error " + cmd + ": depth " + (cmd == "divide" ? "1" : "0") + " .. 63";
+    if (cmd == "divide") return ServerDivide(server, number);
+    const std::uint64_t start = Now();
+    ServerLoad(server);
+    const std::uint64_t nodes = Perft(number);
+    return "ok perft " + std::to_string(number) + ' ' + std::to_string(nodes) + ' ' + std::to_string(Now() - start);
+  }
+  if (cmd == "hash") {
+    if (tokens.size() != 2 || !ServerNumber(tokens[1], number) || !number) return "error hash: MB >= 1";
+    HashtableSetSize(number);
+    return "ok hash " + std::to_string(g_hash_bytes >> 20);
+  }
+  if (cmd == "clear" && tokens.size() == 1) {
+    HashtableClear();
+    return "ok clear";
+  }
+  if (cmd == "quit" && tokens.size() == 1) {
+    server.quit = true;
+    return "ok quit";
   }
+  return "error unknown command: " + line;
 }
 
-void InitRookMagics() {
-  for (int i = 0; i < 64; i++) {
-    const std::uint64_t magics = kRookMoveMagics[i] & (~Bit(i));
-    for (int j = 0; j < 4096; j++) {
-      const std::uint64_t allmoves = PermutateBb(magics, j);
-#ifdef PEXT
-      g_rook_magic_moves[i][Pext(allmoves, kRookMask[i])] = MakeSliderMagicMoves(kRookVectors, i, allmoves);
-#else
-      g_rook_magic_moves[i][RookMagicIndex(i, allmoves)] = MakeSliderMagicMoves(kRookVectors, i, allmoves);
-#endif
+void ServerWrite(const int fd, std::string text) {
+  if (text.empty()) return;
+  text += '\n';
+  for (std::size_t done = 0; done < text.length();) {
+    const ssize_t n = write(fd, text.data() + done, text.length() - done);
+    if (n <= 0) return; // Client gone
+    done += n;
+  }
+}
+
+void ServerSession(const int in, const int out, Server &server) { // Until quit or EOF
+  std::string buffer = "";
+  char chunk[4096];
+  bool eof = false;
+  while (!server.quit && !eof) {
+    const ssize_t n = read(in, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) {HashtableSignalCheck(); continue;}
+    if (n > 0) buffer.append(chunk, n);
+    else {eof = true; buffer += '\n';} // A last line without newline still runs
+    for (std::size_t end; !server.quit && (end = buffer.find('\n')) != std::string::npos; buffer.erase(0, end + 1)) {
+      std::string line = buffer.substr(0, end);
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      ServerWrite(out, ServerCommand(server, line));
     }
   }
 }
 
-std::uint64_t MakeSliderMoves(const int square, const int *slider_vectors) {
-  std::uint64_t moves = 0;
-  const int x_square = Xcoord(square), y_square = Ycoord(square);
+void ServerSocket(const std::string &path, Server &server) { // One client at a time. A client hanging up doesn't stop the server, quit does
+  sockaddr_un addr = {};
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  Assert(path.length() < sizeof(addr.sun_path), "Error #15: Socket path too long");
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.length());
+  unlink(path.c_str());
+  Assert(listener >= 0 && !bind(listener, (sockaddr*) &addr, sizeof(addr)) && !listen(listener, 16), "Error #15: Can't listen on " + path);
+  while (!server.quit) {
+    const int client = accept(listener, 0, 0);
+    if (client < 0) {HashtableSignalCheck(); continue;}
+    ServerSession(client, client, server);
+    close(client);
+  }
+  close(listener);
+  unlink(path.c_str());
+}
 
-  for (int i = 0; i < 4; i++) {
-    const int dx = slider_vectors[2 * i], dy = slider_vectors[2 * i + 1];
-    std::uint64_t tmp = 0;
-    for (int j = 1; j < 8; j++) {
-      const int x = x_square + j * dx, y = y_square + j * dy;
-      if (!OnBoard(x, y)) break;
-      tmp |= Bit(8 * y + x);
+// Microbench
+
+#ifdef MICROBENCH
+std::uint64_t
+  g_microbench_sink = 0; // Keeps the timed results alive
+
+struct Corpus { // Boards reached from one bench position
+  Setup setup;
+  std::vector<Board> boards[2]; // [wtm]
+};
+
+std::vector<Corpus> MicrobenchCorpus() { // Plies 0 .. 2 of every bench position, then every 32nd board of ply 3
+  std::vector<Corpus> corpus;
+  for (const auto &fen : kBenchSuite) {
+    Corpus positions;
+    Fen(fen);
+    positions.setup = SaveSetup();
+    for (int ply = 0; ply <= 3; ply++) {
+      std::uint64_t n = 0;
+      auto visit = [&](const Board *board) {if (ply < 3 || !(n++ % 32)) positions.boards[(ply & 1) ? !g_wtm : g_wtm].push_back(*board);};
+      FrontierWalk(g_wtm, ply, visit);
     }
-    moves |= tmp;
+    corpus.push_back(positions);
   }
+  return corpus;
+}
+
+template <class Op> void MicrobenchRun(const std::string &name, std::vector<Corpus> &corpus, const int rounds, Op op) { // op(positions) -> calls made
+  std::vector<double> ns;
+  std::uint64_t calls = 0;
+  for (int round = 0; round < rounds; round++) {
+    std::chrono::steady_clock::duration elapsed{};
+    calls = 0;
+    for (auto &positions : corpus) {
+      LoadSetup(positions.setup); // Castling squares. Not timed
+      const auto start = std::chrono::steady_clock::now();
+      calls += op(positions);
+      elapsed += std::chrono::steady_clock::now() - start;
+    }
+    ns.push_back(std::chrono::duration<double, std::nano>(elapsed).count() / (double) calls);
+  }
+  std::sort(ns.begin(), ns.end());
+  std::cout << std::left << std::setw(18) << name << std::right << std::setw(10) << calls << std::fixed << std::setprecision(2)
+            << std::setw(12) << ns[ns.size() / 2] << std::setw(10) << ns[ns.size() / 10] << std::setw(10) << ns[(9 * ns.size()) / 10] << std::setw(10) << ns[0] << std::endl;
+}
 
-  return moves;
+template <bool wtm> std::uint64_t MicrobenchMgen(Corpus &positions) {
+  Board moves[kMaxMoves];
+  for (auto &board : positions.boards[wtm]) {
+    g_board = &board;
+    g_microbench_sink += Mgen<wtm>(moves);
+  }
+  return positions.boards[wtm].size();
 }
 
-void InitSliderMoves() {
-  for (int i = 0; i < 64; i++) {
-    g_rook_moves[i]   = MakeSliderMoves(i, kRookVectors);
-    g_bishop_moves[i] = MakeSliderMoves(i, kBishopVectors);
-    g_queen_moves[i]  = g_rook_moves[i] | g_bishop_moves[i];
+template <bool wtm> std::uint64_t MicrobenchAttackers(Corpus &positions) { // Checks on the side to move's king
+  for (auto &board : positions.boards[wtm]) {
+    const std::uint64_t *me = wtm ? board.white : board.black, *you = wtm ? board.black : board.white;
+    g_microbench_sink += Attackers(you, !wtm, Ctz(me[5]), me[6] | you[6]);
   }
+  return positions.boards[wtm].size();
 }
 
-std::uint64_t MakeJumpMoves(const int square, const int len, const int dy, const int *jump_vectors) {
-  std::uint64_t moves = 0;
-  const int x_square = Xcoord(square), y_square = Ycoord(square);
+template <class Visit> std::uint64_t MicrobenchBoards(Corpus &positions, Visit visit) { // visit(wtm, i) with g_board on each board of both sides
+  std::uint64_t i = 0;
+  for (const bool wtm : {false, true}) {
+    for (auto &board : positions.boards[wtm]) {
+      g_board = &board;
+      visit(wtm, i++);
+    }
+  }
+  return i;
+}
 
-  for (int i = 0; i < len; i++) {
-    const int x = x_square + jump_vectors[2 * i], y = y_square + dy * jump_vectors[2 * i + 1];
-    if (OnBoard(x, y)) moves |= Bit(8 * y + x);
+template <bool rook> std::uint64_t MicrobenchSliders(Corpus &positions) { // Every square against every corpus occupancy
+  for (const bool wtm : {false, true}) {
+    for (const auto &board : positions.boards[wtm]) {
+      const std::uint64_t both = board.white[6] | board.black[6];
+      for (int sq = 0; sq < 64; sq++) g_microbench_sink ^= rook ? RookMagicMoves(sq, both) : BishopMagicMoves(sq, both);
+    }
   }
+  return 64 * (positions.boards[0].size() + positions.boards[1].size());
+}
+
+void Microbench(const int rounds, const int hash_mb) {
+  HashtableSetup(hash_mb);
+  std::vector<Corpus> corpus = MicrobenchCorpus();
+  std::cout << (g_pext ? "PEXT" : "Magic") << " sliders, " << rounds << " rounds over " << corpus.size() << " bench positions (plies 0 .. 3)" << std::endl;
+  std::cout << "Component          Calls/round   Median ns   P10 ns    P90 ns    Min ns" << std::endl;
+  MicrobenchRun("MgenW", corpus, rounds, MicrobenchMgen<true>);
+  MicrobenchRun("MgenB", corpus, rounds, MicrobenchMgen<false>);
+  MicrobenchRun("AddPerft", corpus, rounds, [](Corpus &positions) {return MicrobenchBoards(positions, [](const bool wtm, const std::uint64_t i) {AddPerft(Hash(wtm), i + 1, 1 + (i & 7));});});
+  MicrobenchRun("GetPerft", corpus, rounds, [](Corpus &positions) {return MicrobenchBoards(positions, [](const bool wtm, const std::uint64_t i) {std::uint64_t nodes = 0; g_microbench_sink += GetPerft(Hash(wtm), 1 + (i & 7), nodes) + nodes;});});
+  MicrobenchRun("RookMagicMoves", corpus, rounds, MicrobenchSliders<true>);
+  MicrobenchRun("BishopMagicMoves", corpus, rounds, MicrobenchSliders<false>);
+  MicrobenchRun("AttackersW", corpus, rounds, MicrobenchAttackers<true>);
+  MicrobenchRun("AttackersB", corpus, rounds, MicrobenchAttackers<false>);
+  std::cout << "Sink: " << (g_microbench_sink & 0xFFFF) << std::endl;
+}
+#endif
 
-  return moves;
+// Init
+
+bool CpuHasPext() {
+#if defined __x86_64__
+  return __builtin_cpu_supports("bmi2");
+#else
+  return false;
+#endif
 }
 
-void InitJumpMoves() {
-  const int pawn_check_vectors[2 * 2] = {-1,1,1,1}, pawn_1_vectors[1 * 2] = {0,1};
+bool CpuPextFast() { // PDEP/PEXT are microcoded on AMD before Zen 3 (family 19h) and on Hygon (18h)
+#if defined __x86_64__
+  unsigned a = 0, b = 0, c = 0, d = 0;
+  if (!__get_cpuid(0, &a, &b, &c, &d)) return false;
+  const bool amd = b == 0x68747541 || b == 0x6F677948; // "Auth"enticAMD, "Hygo"nGenuine
+  if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+  const unsigned family = ((a >> 8) & 15) + (((a >> 8) & 15) == 15 ? (a >> 20) & 255 : 0);
+  return !amd || family >= 0x19;
+#else
+  return false;
+#endif
+}
 
+void SetSliders(const bool pext) {
+  g_pext = pext;
   for (int i = 0; i < 64; i++) {
-    g_king_moves[i]     = MakeJumpMoves(i, 8,  1, kKingVectors);
-    g_knight_moves[i]   = MakeJumpMoves(i, 8,  1, kKightVectors);
-    g_pawn_checks_w[i]  = MakeJumpMoves(i, 2,  1, pawn_check_vectors);
-    g_pawn_checks_b[i]  = MakeJumpMoves(i, 2, -1, pawn_check_vectors);
-    g_pawn_1_moves_w[i] = MakeJumpMoves(i, 1,  1, pawn_1_vectors);
-    g_pawn_1_moves_b[i] = MakeJumpMoves(i, 1, -1, pawn_1_vectors);
+    g_bishop_magic_moves[i] = pext ? kBishopPextRows[i] : kBishopMagicRows[i];
+    g_rook_magic_moves[i]   = pext ? kRookPextRows[i]   : kRookMagicRows[i];
   }
+}
 
-  for (int i = 0; i < 8; i++) {
-    g_pawn_2_moves_w[ 8 + i] = MakeJumpMoves( 8 + i, 1,  1, pawn_1_vectors) | MakeJumpMoves( 8 + i, 1,  2, pawn_1_vectors);
-    g_pawn_2_moves_b[48 + i] = MakeJumpMoves(48 + i, 1, -1, pawn_1_vectors) | MakeJumpMoves(48 + i, 1, -2, pawn_1_vectors);
+std::uint64_t SliderSpeed(const bool pext) { // ns for 2^18 random rook + bishop lookups (best of 3)
+  std::uint64_t best = ~0ULL, sum = 0;
+  SetSliders(pext);
+  for (int n = 0; n < 3; n++) {
+    std::uint64_t x = 0x9E3779B97F4A7C15ULL;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < (1 << 18); i++) {
+      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+      sum += RookMagicMoves(x & 63, x) ^ BishopMagicMoves((x >> 6) & 63, x);
+    }
+    best = std::min<std::uint64_t>(best, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() + (sum & 1));
   }
+  return best;
 }
 
-void InitZobrist() {
-  for (int i = 0; i < 13; i++) for (int j = 0; j < 64; j++) g_zobrist_board[i][j] = Random8x64();
-  for (int i = 0; i < 64; i++) g_zobrist_ep[i]     = Random8x64();
-  for (int i = 0; i < 16; i++) g_zobrist_castle[i] = Random8x64();
-  for (int i = 0; i <  2; i++) g_zobrist_wtm[i]    = Random8x64();
+void InitSliders() { // -slider=pext|magic|auto|time. Auto: PEXT where cpuid says it's fast. Time: whichever wins a quick run (depends on load)
+  const bool has_pext = CpuHasPext();
+  Assert(g_slider == "auto" || g_slider == "time" || g_slider == "pext" || g_slider == "magic", "Error #13: Bad slider");
+  Assert(g_slider != "pext" || has_pext, "Error #13: No BMI2 (PEXT) on this CPU");
+  if (g_slider == "time" && has_pext) SetSliders(SliderSpeed(true) < SliderSpeed(false));
+  else SetSliders(g_slider == "pext" || (g_slider == "auto" && has_pext && CpuPextFast()));
+}
+
+void InitBatch() { // -simd=avx512|avx2|off|auto
+  const int lanes = CpuBatchLanes();
+  Assert(g_simd == "auto" || g_simd == "avx512" || g_simd == "avx2" || g_simd == "off", "Error #14: Bad simd");
+  Assert(g_simd != "avx512" || lanes >= 8, "Error #14: No AVX-512 (VPOPCNTDQ) on this CPU");
+  Assert(g_simd != "avx2" || lanes >= 4, "Error #14: No AVX2 on this CPU");
+  g_batch = g_simd == "avx512" ? 8 : g_simd == "avx2" ? 4 : g_simd == "auto" ? lanes : 0;
 }
 
 // Execute
@@ -1168,12 +2898,8 @@ void InitZobrist() {
 void Init() {
   g_seed += (std::uint64_t) time(NULL);
   g_board_tmp.reset();
-  InitBishopMagics();
-  InitRookMagics();
-  InitZobrist();
-  InitSliderMoves();
-  InitJumpMoves();
-  HashtableSetSize(256);
+  InitSliders();
+  InitBatch();
   Fen(kStartpos);
   std::atexit(HashtableFreeMemory);
 }
@@ -1185,38 +2911,244 @@ void PrintHelp() {
   std::cout << "-perft [FEN] [DEPTH] [HASH?]: Perft to depth (+ set hash)?" << std::endl;
   std::cout << "-bench [FEN] [HASH?]: Benchmark (+ set hash)?" << std::endl;
   std::cout << "-split [FEN] [DEPTH] [HASH?]: Split numbers (+ set hash)?" << std::endl;
+  std::cout << "-stats [FEN] [DEPTH] [HASH?]: Captures, e.p., castles, promotions, checks and mates per depth (+ set hash)?" << std::endl;
+  std::cout << "-suite [FILE.epd] [DEPTH?] [HASH?]: Check every ;D1 20 ;D2 400 ... line (up to DEPTH). -threads N runs N positions at once" << std::endl;
+  std::cout << "-server [SOCKET?]: Read position/perft/divide/hash/clear/quit lines from stdin (or a Unix socket), answer \"ok ...\" or \"error ...\" to each. The hashtable stays warm" << std::endl;
+  std::cout << "-stress: Hammer the shared hashtable from many threads and verify counts" << std::endl;
+  std::cout << "-threads [N]: Search with N threads (work stealing). Combine with any of the above" << std::endl;
+  std::cout << "-simd-check: Compare the SIMD leaf counters with the scalar one on every board 0 .. 4 plies from the bench positions" << std::endl;
+  std::cout << "-slider=[pext|magic|auto|time]: Sliding piece lookups. Auto: PEXT with BMI2 unless cpuid says AMD before Zen 3. Time: time both at startup. Combine with any of the above" << std::endl;
+  std::cout << "-simd=[avx512|avx2|off|auto]: Count the last ply 8 or 4 boards at a time. Auto takes the widest the CPU has. Combine with any of the above" << std::endl;
+  std::cout << "-makeunmake: 16-bit moves and DoMove/UndoMove on one board instead of copy-make. Combine with any of the above" << std::endl;
+  std::cout << "-hash-load [FILE]: Start from a saved hashtable (its size wins over HASH). Combine with any of the above" << std::endl;
+  std::cout << "-hash-save [FILE]: Save the hashtable at exit, on SIGINT/SIGTERM and after long depths. Combine with any of the above" << std::endl;
+  std::cout << "-journal [FILE]: Append every finished root move to FILE and skip the ones already there. Combine with any of the above" << std::endl;
+  std::cout << "-dedup [FEN] [DEPTH] [PLY] [HASH?]: Perft each unique position PLY moves deep once and multiply (+ set hash)?" << std::endl;
+  std::cout << "-units-export [FEN] [DEPTH] [PLY] [UNITS]: Write the unique positions PLY moves deep as work units for Perft(DEPTH)" << std::endl;
+  std::cout << "-units-work [UNITS] [RESULTS] [FIRST?] [COUNT?] [HASH?]: Perft units (all or COUNT from FIRST) and append to RESULTS" << std::endl;
+  std::cout << "-units-merge [UNITS] [RESULTS...]: Sum the results. Fails if a unit is missing" << std::endl;
+}
+
+bool StripOption(int &argc, char **argv, const std::string &flag, const int args, std::string &value) { // Strips the first "FLAG ARG.." ("-flag=VALUE" if flag ends with '='). value = its argument
+  const bool prefix = flag.back() == '=';
+  for (int i = 1; i + args < argc; i++) {
+    const std::string option = argv[i];
+    if (prefix ? option.compare(0, flag.length(), flag) : option != flag) continue;
+    value = prefix ? option.substr(flag.length()) : args ? argv[i + 1] : "";
+    for (int j = i; j + 1 + args <= argc; j++) argv[j] = argv[j + 1 + args];
+    argc -= 1 + args;
+    return true;
+  }
+  return false;
+}
+
+int Options(int argc, char **argv) { // Strips the options any command takes. Before Init()
+  std::string value;
+  if (StripOption(argc, argv, "-slider=", 0, value)) g_slider = value;
+  if (StripOption(argc, argv, "-simd=", 0, value)) g_simd = value;
+  if (StripOption(argc, argv, "-threads", 1, value)) g_threads = Between<int>(1, std::stoi(value), 256);
+  if (StripOption(argc, argv, "-makeunmake", 0, value)) g_makeunmake = true;
+  while (StripOption(argc, argv, "-hash-load", 1, value)) g_hash_load = value;
+  while (StripOption(argc, argv, "-hash-save", 1, value)) {
+    g_hash_save     = value;
+    g_hash_save_tmp = g_hash_save + ".tmp";
+    struct sigaction action = {}; // No SA_RESTART: a server waiting for input wakes up
+    action.sa_handler = HashtableSignal;
+    sigaction(SIGINT,  &action, 0);
+    sigaction(SIGTERM, &action, 0);
+    g_hash_saver = true;
+  }
+  if (StripOption(argc, argv, "-journal", 1, value)) {
+    g_journal = value;
+    JournalLoad();
+  }
+  return argc;
+}
+
+void RunUnitsExport(const std::string fen, const int depth, const int ply, const std::string units) {
+  Fen(fen);
+  UnitsExport(depth, ply, units);
+}
+
+void RunUnitsWork(const std::string units, const std::string results, const std::uint64_t first, const std::uint64_t count, const int hash_mb) {
+  HashtableSetup(hash_mb);
+  UnitsWork(units, results, first, count);
+  HashtableFinish();
+}
+
+void RunDedup(const std::string fen, const int depth, const int ply, const int hash_mb) {
+  HashtableSetup(hash_mb);
+  Fen(fen);
+  PerftDedup(depth, ply);
+  HashtableFinish();
+}
+
+bool RunEpd(const std::string file_name, const int max_depth, const int hash_mb) {
+  HashtableSetup(hash_mb);
+  const bool ok = EpdRun(file_name, max_depth);
+  HashtableFinish();
+  return ok;
+}
+
+void RunStats(const std::string fen, const int depth, const int hash_mb) {
+  Fen(fen);
+  StatsRun(depth, hash_mb);
 }
 
 void PrintVersion() {
   std::cout << kName << std::endl;
 }
 
+void RunServer(const std::string socket_path) { // Tables, hashtable and threads stay warm between commands
+  Server server;
+  HashtableSetup(0);
+  server.board = *g_board;
+  server.wtm   = g_wtm;
+  std::signal(SIGPIPE, SIG_IGN);
+  if (socket_path.empty()) ServerSession(STDIN_FILENO, STDOUT_FILENO, server);
+  else ServerSocket(socket_path, server);
+  HashtableFinish();
+}
+
 void RunBench(const int hash_mb) {
-  HashtableSetSize(hash_mb);
+  HashtableSetup(hash_mb);
   Bench();
+  HashtableFinish();
 }
 
 void RunSplit(const std::string fen, const int depth, const int hash_mb) {
-  HashtableSetSize(hash_mb);
+  HashtableSetup(hash_mb);
   Fen(fen);
   Split(depth);
+  HashtableFinish();
 }
 
 void RunPerft(const std::string fen, const int depth, const int hash_mb) {
-  HashtableSetSize(hash_mb);
+  HashtableSetup(hash_mb);
   Fen(fen);
   PerftRun(depth);
+  HashtableFinish();
 }}
 
+// Library (make lib): the C API of lastemperor.h
+
+#ifdef LIBRARY
+struct lastemperor_ctx { // One position and one hashtable. Every call runs on the caller's thread
+  lastemperor::Setup setup;
+  lastemperor::Board board;
+  std::string error;
+};
+
+template <class Op> int LibraryCall(lastemperor_ctx *ctx, Op op) { // Loads ctx into this thread's globals. Assert()s become -1
+  if (!ctx) return -1;
+  try {
+    lastemperor::LoadSetup(ctx->setup);
+    lastemperor::g_board_tmp = ctx->board;
+    lastemperor::g_board     = &lastemperor::g_board_tmp;
+    const int ret = op();
+    ctx->setup = lastemperor::SaveSetup(); // Hashtable age
+    ctx->error = "";
+    return ret;
+  } catch (const std::exception &e) {
+    ctx->error = e.what();
+    return -1;
+  }
+}
+
+int LibraryMoves(lastemperor_ctx *ctx, const int depth, lastemperor_move *moves, const int max_moves) {
+  return LibraryCall(ctx, [&]() {
+    lastemperor::Assert(depth >= 1 && depth <= 63, "Error #16: Depth 1 .. 63");
+    const auto divide = lastemperor::Divide(depth);
+    lastemperor::Assert(moves && (int) divide.size() <= max_moves, "Error #16: Move buffer too small");
+    for (std::size_t i = 0; i < divide.size(); i++) {
+      std::snprintf(moves[i].name, sizeof(moves[i].name), "%s", divide[i].first.c_str());
+      moves[i].nodes = divide[i].second;
+    }
+    return (int) divide.size();
+  });
+}
+
+lastemperor_ctx *lastemperor_new(const int hash_mb) {
+  static std::once_flag once;
+  std::call_once(once, []() {lastemperor::InitSliders(); lastemperor::InitBatch();});
+  lastemperor_ctx *ctx = 0;
+  try {
+    ctx = new lastemperor_ctx;
+    lastemperor::g_myhash = 0; // Belongs to another context
+    lastemperor::HashtableSetSize(hash_mb);
+    lastemperor::Fen(lastemperor::kStartpos);
+    ctx->board = *lastemperor::g_board;
+    ctx->setup = lastemperor::SaveSetup();
+    return ctx;
+  } catch (const std::exception &e) { // std::bad_alloc too
+    delete ctx;
+    return 0;
+  }
+}
+
+void lastemperor_free(lastemperor_ctx *ctx) {
+  if (!ctx) return;
+  lastemperor::g_myhash     = ctx->setup.hash;
+  lastemperor::g_hash_bytes = ctx->setup.hash_bytes;
+  lastemperor::HashtableFreeMemory();
+  delete ctx;
+}
+
+int lastemperor_set_fen(lastemperor_ctx *ctx, const char *fen) {
+  return LibraryCall(ctx, [&]() {
+    lastemperor::Assert(fen && lastemperor::FenOk(fen), "Error #1: Bad fen");
+    lastemperor::Fen(fen);
+    ctx->board = *lastemperor::g_board;
+    return 0;
+  });
+}
+
+int lastemperor_perft(lastemperor_ctx *ctx, const int depth, std::uint64_t *nodes) {
+  return LibraryCall(ctx, [&]() {
+    lastemperor::Assert(depth >= 0 && depth <= 63 && nodes, "Error #16: Depth 0 .. 63");
+    *nodes = lastemperor::Perft(depth);
+    return 0;
+  });
+}
+
+int lastemperor_divide(lastemperor_ctx *ctx, const int depth, lastemperor_move *moves, const int max_moves) {
+  return LibraryMoves(ctx, depth, moves, max_moves);
+}
+
+int lastemperor_legal_moves(lastemperor_ctx *ctx, lastemperor_move *moves, const int max_moves) {
+  return LibraryMoves(ctx, 1, moves, max_moves);
+}
+
+const char *lastemperor_error(const lastemperor_ctx *ctx) {
+  return ctx ? ctx->error.c_str() : "Error #16: No context";
+}
+#else
+
 // "War demands sacrifice of the people. It gives only suffering in return." -- Frederic Clemson Howe
 int main(int argc, char **argv) {
+  argc = lastemperor::Options(argc, argv);
   lastemperor::Init();
-  
+
+#ifdef MICROBENCH
+  lastemperor::Microbench(argc >= 2 ? std::stoi(argv[1]) : 31, argc == 3 ? std::stoi(argv[2]) : 0); // lastemperor-microbench [ROUNDS] [HASH]
+  return EXIT_SUCCESS;
+#endif
+
   if (argc == 2 && std::string(argv[1]) == "--version") {lastemperor::PrintVersion();}
   else if (argc >= 2 && std::string(argv[1]) == "-bench") {lastemperor::RunBench(argc == 3 ? std::stoi(argv[2]) : 0);}
   else if (argc >= 4 && std::string(argv[1]) == "-perft") {lastemperor::RunPerft(std::string(argv[2]), std::stoi(argv[3]), argc == 5 ? std::stoi(argv[4]) : 0);}
+  else if (argc >= 3 && std::string(argv[1]) == "-suite") {return lastemperor::RunEpd(std::string(argv[2]), argc >= 4 ? std::stoi(argv[3]) : 99, argc == 5 ? std::stoi(argv[4]) : 0) ? EXIT_SUCCESS : EXIT_FAILURE;}
+  else if (argc == 2 && std::string(argv[1]) == "-stress") {lastemperor::Stress();}
+  else if (argc == 2 && std::string(argv[1]) == "-simd-check") {lastemperor::SimdCheck();}
+  else if (argc >= 2 && argc <= 3 && std::string(argv[1]) == "-server") {lastemperor::RunServer(argc == 3 ? std::string(argv[2]) : "");}
+  else if (argc >= 4 && std::string(argv[1]) == "-stats") {lastemperor::RunStats(std::string(argv[2]), std::stoi(argv[3]), argc == 5 ? std::stoi(argv[4]) : 0);}
   else if (argc >= 4 && std::string(argv[1]) == "-split") {lastemperor::RunSplit(std::string(argv[2]), std::stoi(argv[3]), argc == 5 ? std::stoi(argv[4]) : 0);}
+  else if (argc >= 5 && std::string(argv[1]) == "-dedup") {lastemperor::RunDedup(std::string(argv[2]), std::stoi(argv[3]), std::stoi(argv[4]), argc == 6 ? std::stoi(argv[5]) : 0);}
+  else if (argc == 6 && std::string(argv[1]) == "-units-export") {lastemperor::RunUnitsExport(std::string(argv[2]), std::stoi(argv[3]), std::stoi(argv[4]), std::string(argv[5]));}
+  else if (argc >= 4 && std::string(argv[1]) == "-units-work") {lastemperor::RunUnitsWork(std::string(argv[2]), std::string(argv[3]), argc >= 5 ? std::stoull(argv[4]) : 0, argc >= 6 ? std::stoull(argv[5]) : ~0ULL, argc == 7 ? std::stoi(argv[6]) : 0);}
+  else if (argc >= 4 && std::string(argv[1]) == "-units-merge") {return lastemperor::UnitsMerge(std::string(argv[2]), std::vector<std::string>(argv + 3, argv + argc)) ? EXIT_SUCCESS : EXIT_FAILURE;}
   else {lastemperor::PrintHelp();}
   
   return EXIT_SUCCESS;
 }
+#endif
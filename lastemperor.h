@@ -0,0 +1,92 @@
+/*
+LastEmperor. Linux Chess960 perft program
+Copyright (C) 2019-2020 Toni Helminen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// LastEmperor as a library: make lib -> liblastemperor.a + liblastemperor.so
+// A context owns a position (with its Chess960 castling rooks) and a hashtable.
+// Contexts are independent: use each from one thread at a time, different contexts from different threads at once.
+// Calls return -1 on error and lastemperor_error() says why. Nothing exits the process.
+
+#ifndef LASTEMPEROR_H
+#define LASTEMPEROR_H
+
+#include <stdint.h>
+
+#define LASTEMPEROR_API __attribute__((visibility("default")))
+#define LASTEMPEROR_MAX_MOVES 256 // Enough for any legal position (218)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lastemperor_ctx lastemperor_ctx;
+
+typedef struct {
+  char name[8];   // "e2e4", "e7e8q". Castling is king takes rook, "e1h1" or "e1a1", so no two moves share a name
+  uint64_t nodes; // Perft(depth - 1) below the move. 1 from lastemperor_legal_moves()
+} lastemperor_move;
+
+LASTEMPEROR_API lastemperor_ctx *lastemperor_new(int hash_mb); // Start position. hash_mb <= 0: 256 MB. NULL if out of memory
+LASTEMPEROR_API void lastemperor_free(lastemperor_ctx *ctx);
+LASTEMPEROR_API int lastemperor_set_fen(lastemperor_ctx *ctx, const char *fen); // KQkq or Shredder (HAha) castling. 0 or -1
+LASTEMPEROR_API int lastemperor_perft(lastemperor_ctx *ctx, int depth, uint64_t *nodes); // 0 or -1
+LASTEMPEROR_API int lastemperor_divide(lastemperor_ctx *ctx, int depth, lastemperor_move *moves, int max_moves); // Moves written or -1
+LASTEMPEROR_API int lastemperor_legal_moves(lastemperor_ctx *ctx, lastemperor_move *moves, int max_moves); // Moves written or -1
+LASTEMPEROR_API const char *lastemperor_error(const lastemperor_ctx *ctx); // Last error of ctx, "" after a good call
+
+#ifdef __cplusplus
+}
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lastemperor {
+
+class Context { // C++ wrapper: owns one lastemperor_ctx
+
+ public:
+
+  explicit Context(const int hash_mb = 0) : ctx(lastemperor_new(hash_mb)) {}
+  ~Context() {if (ctx) lastemperor_free(ctx);}
+  Context(const Context&) = delete;
+  Context &operator=(const Context&) = delete;
+
+  bool Ok() const {return ctx != 0;} // False if lastemperor_new() ran out of memory. Then every call fails
+  bool SetFen(const std::string &fen) {return ctx && !lastemperor_set_fen(ctx, fen.c_str());}
+  bool Perft(const int depth, uint64_t &nodes) {return ctx && !lastemperor_perft(ctx, depth, &nodes);}
+  bool Divide(const int depth, std::vector<std::pair<std::string, uint64_t>> &moves) {return Moves(ctx ? lastemperor_divide(ctx, depth, buffer, LASTEMPEROR_MAX_MOVES) : -1, moves);}
+  bool LegalMoves(std::vector<std::pair<std::string, uint64_t>> &moves) {return Moves(ctx ? lastemperor_legal_moves(ctx, buffer, LASTEMPEROR_MAX_MOVES) : -1, moves);}
+  std::string Error() const {return ctx ? lastemperor_error(ctx) : "Out of memory";}
+
+ private:
+
+  bool Moves(const int len, std::vector<std::pair<std::string, uint64_t>> &moves) {
+    moves.clear();
+    for (int i = 0; i < len; i++) moves.push_back({buffer[i].name, buffer[i].nodes});
+    return len >= 0;
+  }
+
+  lastemperor_ctx *ctx;
+  lastemperor_move buffer[LASTEMPEROR_MAX_MOVES];
+};
+
+} // namespace lastemperor
+
+#endif
+
+#endif